@@ -28,6 +28,19 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include "ltga.h"
 #include <fstream>
 #include <stdlib.h>
+#include <string.h>        // memcpy(), memset(), memmove()
+#ifndef _WIN32
+#include <fcntl.h>         // open()
+#include <unistd.h>        // close()
+#include <sys/stat.h>      // fstat()
+#include <sys/mman.h>      // mmap(), munmap()
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TGA_SSSE3
+#include <tmmintrin.h>     // _mm_shuffle_epi8()
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>      // vld3q_u8(), vld4q_u8()
+#endif
 
 //--------------------------------------------------
 // global functions
@@ -47,6 +60,243 @@ void ReadData(std::ifstream &file, char* data, uint size)
     }
 }
 
+//--------------------------------------------------
+// RLE decoding
+//--------------------------------------------------
+#define TGA_RLEBLOCK 65536  // bytes read from file per refill
+
+// Buffers the compressed stream so that packets are parsed out of
+// memory instead of with one ReadData() call per packet header.
+class TGABlockReader
+{
+public:
+    TGABlockReader(std::ifstream &file) : m_file(file), m_pos(0), m_len(0)
+    {
+        m_buf = (byte*) malloc(TGA_RLEBLOCK);
+    }
+    ~TGABlockReader() { free(m_buf); }
+
+    // makes sure at least size (<= TGA_RLEBLOCK) bytes are buffered,
+    // returns a pointer to them or 0 on premature end of file
+    const byte *Need(uint size)
+    {
+        if (m_len-m_pos < size)
+        {
+            memmove(m_buf, m_buf+m_pos, m_len-m_pos);
+            m_len -= m_pos;
+            m_pos = 0;
+            m_file.read((char*)m_buf+m_len, TGA_RLEBLOCK-m_len);
+            m_len += (uint) m_file.gcount();
+            if (m_len < size)
+                return 0;
+        }
+        return m_buf+m_pos;
+    }
+    void Skip(uint size) { m_pos += size; }
+
+private:
+    std::ifstream &m_file;
+    byte *m_buf;
+    uint m_pos;
+    uint m_len;
+};
+
+// An lfStream load in progress: the file positioned at the next pixel
+// data to read and the number of pixels loaded so far.
+struct TGAStream
+{
+    TGAStream() : in(file), current(0) {}
+
+    std::ifstream file;
+    TGABlockReader in;      // only used if rle
+    uint current;
+    bool rle;
+    bool swap;              // swap BGR(A) to RGB(A) as loaded
+};
+
+// Replicates the first pixel at dst count times.  Each memcpy()
+// doubles the filled region, so long runs are written with wide
+// stores instead of a byte at a time.
+template <uint BPP>
+static inline void TGAFillRun(byte *dst, uint count)
+{
+    uint filled = BPP, total = count*BPP;
+    while (filled < total)
+    {
+        uint n = total-filled < filled ? total-filled : filled;
+        memcpy(dst+filled, dst, n);
+        filled += n;
+    }
+}
+
+template <>
+inline void TGAFillRun<1>(byte *dst, uint count)
+{
+    memset(dst+1, dst[0], count-1);
+}
+
+template <>
+inline void TGAFillRun<4>(byte *dst, uint count)
+{
+    uint pixel;
+    memcpy(&pixel, dst, 4);
+    for (uint i = 1; i < count; i++)
+        memcpy(dst+i*4, &pixel, 4);
+}
+
+// Decodes whole packets of BPP byte pixels into pixels, starting at
+// pixel current, until at least pixel until is decoded.  Returns false
+// if the file ends early; a packet that runs past the end of the
+// image, npixels, is truncated.
+template <uint BPP>
+static bool TGADecodeRLE(TGABlockReader &in, byte *pixels, uint &current,
+                         uint until, uint npixels)
+{
+    const byte *p;
+    uint length, count;
+
+    while (current < until)
+    {
+        if (!(p = in.Need(1)))
+            return false;
+        length = (p[0] & 127) + 1;   // how many pixels are encoded using this packet
+        count = length > npixels-current ? npixels-current : length;
+
+        if ((p[0] & 128) == 128)
+        {   // this is an rle packet
+            if (!(p = in.Need(1+BPP)))
+                return false;
+            memcpy(pixels+current*BPP, p+1, BPP);
+            TGAFillRun<BPP>(pixels+current*BPP, count);
+            in.Skip(1+BPP);
+        }
+        else
+        {   // this is a raw packet
+            if (!(p = in.Need(1+length*BPP)))
+                return false;
+            memcpy(pixels+current*BPP, p+1, count*BPP);
+            in.Skip(1+length*BPP);
+        }
+        current += count;
+    }
+    return true;
+}
+
+static bool TGADecodeRLE(TGABlockReader &in, byte *pixels, uint &current,
+                         uint until, uint npixels, uint bpp)
+{
+    switch (bpp)
+    {
+    case 1:
+        return TGADecodeRLE<1>(in, pixels, current, until, npixels);
+    case 3:
+        return TGADecodeRLE<3>(in, pixels, current, until, npixels);
+    case 4:
+        return TGADecodeRLE<4>(in, pixels, current, until, npixels);
+    default:
+        return TGADecodeRLE<2>(in, pixels, current, until, npixels);
+    }
+}
+
+//--------------------------------------------------
+// BGR(A) <-> RGB(A) swizzle
+//--------------------------------------------------
+#ifdef TGA_SSSE3
+// 16 pixels of 3 bytes span three vectors, with pixels 5 and 10
+// straddling vector boundaries.  All three vectors are loaded before
+// any is stored, each output vector is the OR of shuffles of its
+// neighbours (-1 zeroes a byte).
+__attribute__((target("ssse3")))
+static uint TGASwizzle24SSSE3(byte *pixels, uint npixels)
+{
+    const __m128i a_a = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, -1);
+    const __m128i a_b = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1);
+    const __m128i b_a = _mm_setr_epi8(-1, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b_b = _mm_setr_epi8(0, -1, 4, 3, 2, 7, 6, 5, 10, 9, 8, 13, 12, 11, -1, 15);
+    const __m128i b_c = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, -1);
+    const __m128i c_b = _mm_setr_epi8(14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i c_c = _mm_setr_epi8(-1, 3, 2, 1, 6, 5, 4, 9, 8, 7, 12, 11, 10, 15, 14, 13);
+    uint i = 0;
+
+    for (; i+16 <= npixels; i += 16)
+    {
+        __m128i *p = (__m128i*)(pixels+i*3);
+        __m128i a = _mm_loadu_si128(p);
+        __m128i b = _mm_loadu_si128(p+1);
+        __m128i c = _mm_loadu_si128(p+2);
+
+        _mm_storeu_si128(p, _mm_or_si128(_mm_shuffle_epi8(a, a_a),
+                                         _mm_shuffle_epi8(b, a_b)));
+        _mm_storeu_si128(p+1, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, b_a),
+                                                        _mm_shuffle_epi8(b, b_b)),
+                                           _mm_shuffle_epi8(c, b_c)));
+        _mm_storeu_si128(p+2, _mm_or_si128(_mm_shuffle_epi8(b, c_b),
+                                           _mm_shuffle_epi8(c, c_c)));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static uint TGASwizzle32SSSE3(byte *pixels, uint npixels)
+{
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    uint i = 0;
+
+    for (; i+4 <= npixels; i += 4)
+    {
+        __m128i *p = (__m128i*)(pixels+i*4);
+        _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), mask));
+    }
+    return i;
+}
+#endif
+
+#ifdef __ARM_NEON
+// vld3q/vld4q de-interleave 16 pixels into one register per channel
+static uint TGASwizzleNEON(byte *pixels, uint npixels, uint bpp)
+{
+    uint i = 0;
+
+    if (bpp == 3)
+        for (; i+16 <= npixels; i += 16)
+        {
+            uint8x16x3_t v = vld3q_u8(pixels+i*3);
+            uint8x16_t t = v.val[0]; v.val[0] = v.val[2]; v.val[2] = t;
+            vst3q_u8(pixels+i*3, v);
+        }
+    else
+        for (; i+16 <= npixels; i += 16)
+        {
+            uint8x16x4_t v = vld4q_u8(pixels+i*4);
+            uint8x16_t t = v.val[0]; v.val[0] = v.val[2]; v.val[2] = t;
+            vst4q_u8(pixels+i*4, v);
+        }
+    return i;
+}
+#endif
+
+// Swaps the first and third byte of npixels pixels of bpp (3 or 4)
+// bytes each, vectorized where the CPU allows it.
+static void TGASwizzleRB(byte *pixels, uint npixels, uint bpp)
+{
+    uint i = 0;
+    byte temp;
+
+#ifdef TGA_SSSE3
+    if (__builtin_cpu_supports("ssse3"))
+        i = bpp == 3 ? TGASwizzle24SSSE3(pixels, npixels)
+                     : TGASwizzle32SSSE3(pixels, npixels);
+#elif defined(__ARM_NEON)
+    i = TGASwizzleNEON(pixels, npixels, bpp);
+#endif
+    for (; i < npixels; i++)
+    {
+        temp = pixels[i*bpp];
+        pixels[i*bpp] = pixels[i*bpp+2];
+        pixels[i*bpp+2] = temp;
+    }
+}
+
 //--------------------------------------------------
 LTGA::LTGA()
 {
@@ -57,6 +307,11 @@ LTGA::LTGA()
     m_alphaDepth = 0;
     m_type = itUndefined;
     m_pixels = 0;
+    m_map = 0;
+    m_mapsize = 0;
+    m_bgr = false;
+    m_pak = false;
+    m_stream = 0;
 }
 
 
@@ -70,6 +325,11 @@ LTGA::LTGA(const std::string &filename)
     m_alphaDepth = 0;
     m_type = itUndefined;
     m_pixels = 0;
+    m_map = 0;
+    m_mapsize = 0;
+    m_bgr = false;
+    m_pak = false;
+    m_stream = 0;
     LoadFromFile(filename);
 }
 
@@ -82,6 +342,13 @@ LTGA::LTGA(uint _width, uint _height) : m_height(_height), m_width(_width) {
 
     m_type = itRGB;
 
+    m_pixels = 0;
+    m_map = 0;
+    m_mapsize = 0;
+    m_bgr = false;
+    m_pak = false;
+    m_stream = 0;
+
 #if 0
     m_pixels = (byte*) malloc(m_width*m_height*(m_pixelDepth/8));
 
@@ -100,7 +367,7 @@ LTGA::~LTGA()
 
 
 //--------------------------------------------------
-bool LTGA::LoadFromFile(const std::string &filename)
+bool LTGA::LoadFromFile(const std::string &filename, uint flags)
 {
     if (m_loaded)
         Clear();
@@ -110,12 +377,19 @@ bool LTGA::LoadFromFile(const std::string &filename)
     file.open(filename.c_str(), std::ios::binary);
     if (!file.is_open())
         return false;
+    TGAReadError = 0;
+
+    char magic[8];
+    file.read(magic, sizeof(magic));
+    if (file.gcount() == sizeof(magic) &&
+        !memcmp(magic, LTGA_PAKMAGIC, sizeof(magic)))
+        return LoadPak(file, filename, flags);
+    file.clear();
+    file.seekg(0, std::ios::beg);
 
     bool rle = false;
     bool truecolor = false;
-    uint CurrentPixel = 0;
     byte ch_buf1, ch_buf2;
-    byte buf1[1000];
 
     byte IDLength;
     byte IDColorMapType;
@@ -180,34 +454,50 @@ bool LTGA::LoadFromFile(const std::string &filename)
 
     file.seekg(IDLength, std::ios::cur);
 
-    m_pixels = (byte*) malloc(m_width*m_height*(m_pixelDepth/8));
+    // uncompressed pixels are laid out in the file exactly as we
+    // want them in memory, so map them instead of copying them
+    if ((flags & lfMapped) && !rle)
+        MapFile(filename, (size_t) file.tellg(),
+                m_width*m_height*(m_pixelDepth/8));
+    if (!m_map)
+        m_pixels = (byte*) malloc(m_width*m_height*(m_pixelDepth/8));
 
-    if (!rle)
-        ReadData(file, (char*)m_pixels, m_width*m_height*(m_pixelDepth/8));
-    else
+    // leave the pixels to LoadMore()
+    if (!m_map && (flags & lfStream))
     {
-        while (CurrentPixel < m_width*m_height -1)
-        {
-            ReadData(file, (char*)&ch_buf1, 1);
-            if ((ch_buf1 & 128) == 128)
-            {   // this is an rle packet
-                ch_buf2 = (byte)((ch_buf1 & 127) + 1);   // how many pixels are encoded using this packet
-                ReadData(file, (char*)buf1, m_pixelDepth/8);
-                for (uint i=CurrentPixel; i<CurrentPixel+ch_buf2; i++)
-                    for (uint j=0; j<m_pixelDepth/8; j++)
-                        m_pixels[i*m_pixelDepth/8+j] = buf1[j];
-                CurrentPixel += ch_buf2;
-            }
-            else
-            {   // this is a raw packet
-                ch_buf2 = (byte)((ch_buf1 & 127) + 1);
-                ReadData(file, (char*)buf1, m_pixelDepth/8*ch_buf2);
-                for (uint i=CurrentPixel; i<CurrentPixel+ch_buf2; i++)
-                    for (uint j=0; j<m_pixelDepth/8; j++)
-                        m_pixels[i*m_pixelDepth/8+j] =  buf1[(i-CurrentPixel)*m_pixelDepth/8+j];
-                CurrentPixel += ch_buf2;
+        m_stream = new TGAStream;
+        m_stream->file.open(filename.c_str(), std::ios::binary);
+        m_stream->file.seekg(file.tellg());
+        m_stream->rle = rle;
+        m_stream->swap = false;
+        if ((m_type == itRGB) || (m_type == itRGBA))
+            if ((m_pixelDepth == 24) || (m_pixelDepth == 32))
+            {
+                m_bgr = (flags & lfKeepBGR) != 0;
+                m_stream->swap = !m_bgr;
             }
+        if (!m_stream->file.is_open() || TGAReadError != 0)
+        {
+            Clear();
+            return false;
         }
+        m_loaded = true;
+        return true;
+    }
+
+    if (!rle)
+    {
+        if (!m_map)
+            ReadData(file, (char*)m_pixels, m_width*m_height*(m_pixelDepth/8));
+    }
+    else
+    {
+        TGABlockReader in(file);
+        uint current = 0;
+
+        if (!TGADecodeRLE(in, m_pixels, current, m_width*m_height,
+                          m_width*m_height, m_pixelDepth/8))
+            TGAReadError = 1;
     }
 
     if (TGAReadError != 0)
@@ -221,29 +511,73 @@ bool LTGA::LoadFromFile(const std::string &filename)
 
     // swap BGR(A) to RGB(A)
 
-    byte temp;
     if ((m_type == itRGB) || (m_type == itRGBA))
         if ((m_pixelDepth == 24) || (m_pixelDepth == 32))
-            for (uint i= 0; i<m_width*m_height; i++)
-            {
-                temp = m_pixels[i*m_pixelDepth/8];
-                m_pixels[i*m_pixelDepth/8] = m_pixels[i*m_pixelDepth/8+2];
-                m_pixels[i*m_pixelDepth/8+2] = temp;
-            }
+        {
+            m_bgr = true;
+            if (!(flags & lfKeepBGR))
+                SwapRB();
+        }
 
     return true;
 }
 
+//--------------------------------------------------
+bool LTGA::LoadMore(size_t size)
+{
+    if (!m_stream)
+        return true;
+
+    uint bpp = m_pixelDepth/8;
+    uint npixels = m_width*m_height;
+    uint start = m_stream->current;
+    uint until = (uint) ((size+bpp-1)/bpp);
+    bool ok = true;
+
+    if (until > npixels)
+        until = npixels;
+    if (until <= start)
+        return true;
+
+    if (m_stream->rle)
+        ok = TGADecodeRLE(m_stream->in, m_pixels, m_stream->current, until,
+                          npixels, bpp);
+    else
+    {
+        m_stream->file.read((char*)m_pixels+start*bpp, (until-start)*bpp);
+        m_stream->current += (uint) m_stream->file.gcount()/bpp;
+        ok = m_stream->current == until;
+    }
+
+    if (m_stream->swap)
+        TGASwizzleRB(m_pixels+start*bpp, m_stream->current-start, bpp);
+
+    if (!ok)
+        memset(m_pixels+m_stream->current*bpp, 0,
+               (npixels-m_stream->current)*bpp);
+    if (!ok || m_stream->current == npixels)
+    {
+        delete m_stream;
+        m_stream = 0;
+    }
+    return ok;
+}
+
+//--------------------------------------------------
+size_t LTGA::GetLoadedSize() const
+{
+    if (m_stream)
+        return (size_t) m_stream->current*(m_pixelDepth/8);
+    return m_loaded ? (size_t) m_width*m_height*(m_pixelDepth/8) : 0;
+}
+
 void LTGA::SwapRB() {
-    byte temp;
     if ((m_type == itRGB) || (m_type == itRGBA))
         if ((m_pixelDepth == 24) || (m_pixelDepth == 32))
-            for (uint i= 0; i<m_width*m_height; i++)
-            {
-                temp = m_pixels[i*m_pixelDepth/8];
-                m_pixels[i*m_pixelDepth/8] = m_pixels[i*m_pixelDepth/8+2];
-                m_pixels[i*m_pixelDepth/8+2] = temp;
-            }
+        {
+            TGASwizzleRB(m_pixels, m_width*m_height, m_pixelDepth/8);
+            m_bgr = !m_bgr;
+        }
 }
 
 struct TGA_HEADER
@@ -291,23 +625,168 @@ void LTGA::WriteToFile(const std::string& name) {
 
   //cerr << "wrote header with " << sizeof(th) << " bytes." << endl;
 
-  SwapRB();
+  bool swap = !m_bgr;
+  if (swap)
+    SwapRB();
 
   os.write((char*)pltga->GetPixels(), pltga->GetImageWidth()*pltga->GetImageHeight()*(pltga->GetPixelDepth()/8));
 
   os.close();
 
-  SwapRB();
+  if (swap)
+    SwapRB();
 }
 
 
 
+//--------------------------------------------------
+// containers are written in network byte order
+static uint TGANet16(unsigned short v)
+{
+    byte *p = (byte*) &v;
+    return (p[0] << 8) | p[1];
+}
+
+static uint TGANet32(uint v)
+{
+    byte *p = (byte*) &v;
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+bool LTGA::LoadPak(std::ifstream &file, const std::string &filename, uint flags)
+{
+    LTGAPakHeader hdr;
+    uint size, offset;
+
+    file.seekg(0, std::ios::beg);
+    ReadData(file, (char*)&hdr, sizeof(hdr));
+    if (TGAReadError != 0)
+        return false;
+
+    m_width = TGANet16(hdr.im_width);
+    m_height = TGANet16(hdr.im_height);
+    m_pixelDepth = hdr.im_depth*8;
+    m_alphaDepth = hdr.alpha;
+    if (m_pixelDepth == 8 || m_pixelDepth == 16)
+        m_type = itGreyscale;
+    else if (m_pixelDepth == 24)
+        m_type = itRGB;
+    else if (m_pixelDepth == 32)
+        m_type = itRGBA;
+    else
+    {
+        Clear();
+        return false;
+    }
+
+    size = m_width*m_height*(m_pixelDepth/8);
+    offset = TGANet32(hdr.pixoffset);
+    if (TGANet32(hdr.pixsize) != size)
+    {
+        Clear();
+        return false;
+    }
+
+    // pixels are already in RGB(A) order, lfKeepBGR is moot
+    if (flags & lfMapped)
+        MapFile(filename, offset, size);
+    if (!m_map)
+    {
+        m_pixels = (byte*) malloc(size);
+        file.seekg(offset, std::ios::beg);
+        ReadData(file, (char*)m_pixels, size);
+        if (TGAReadError != 0)
+        {
+            Clear();
+            return false;
+        }
+    }
+
+    m_pak = true;
+    m_loaded = true;
+    return true;
+}
+
+
+//--------------------------------------------------
+const byte *LTGA::GetParity(uint mss, uint datasize, uint fwnd)
+{
+    LTGAPakHeader *hdr = (LTGAPakHeader*) m_map;
+    LTGAPakFEC *fec;
+    size_t pixsize = (size_t) m_width*m_height*(m_pixelDepth/8);
+    size_t nblocks;
+
+    if (!m_pak || !m_map || !datasize || !fwnd)
+        return 0;
+    // blocks for every fwnd-full of segments, as the sender sends them
+    nblocks = ((pixsize+datasize-1)/datasize + fwnd-1)/fwnd;
+    for (uint i = 0; i < TGANet32(hdr->nfec) && i < LTGA_PAKMAXFEC; i++)
+    {
+        fec = &hdr->fec[i];
+        if (TGANet16(fec->mss) == mss && fec->fwnd == fwnd &&
+            TGANet32(fec->datasize) == datasize &&
+            TGANet32(fec->nblocks) >= nblocks &&
+            (size_t) TGANet32(fec->offset) +
+            (size_t) TGANet32(fec->nblocks)*datasize <= m_mapsize)
+            return m_map+TGANet32(fec->offset);
+    }
+    return 0;
+}
+
+
+//--------------------------------------------------
+// The mapping is private and writable so that the BGR to RGB swap
+// (and SwapRB()) can be done in place: only the pages actually
+// written to are copied, a greyscale image is served straight out
+// of the page cache.
+bool LTGA::MapFile(const std::string &filename, size_t offset, size_t size)
+{
+#ifdef _WIN32
+    return false;
+#else
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < offset+size)
+    {
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE, fd, 0);
+    close(fd);  // the mapping holds its own reference to the file
+    if (map == MAP_FAILED)
+        return false;
+
+    m_map = (byte*) map;
+    m_mapsize = (size_t) st.st_size;
+    m_pixels = m_map+offset;
+    return true;
+#endif
+}
+
+
 //--------------------------------------------------
 void LTGA::Clear()
 {
+    delete m_stream;
+    m_stream = 0;
+#ifndef _WIN32
+    if (m_map)
+        munmap(m_map, m_mapsize);
+    else
+#endif
     if (m_pixels)
       free(m_pixels);
     m_pixels = 0;
+    m_map = 0;
+    m_mapsize = 0;
+    m_bgr = false;
+    m_pak = false;
     m_loaded = false;
     m_width = 0;
     m_height = 0;
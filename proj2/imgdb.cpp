@@ -25,6 +25,7 @@
 #include <iomanip>         // setw()
 #include <fstream>
 #include <cstring>
+#include <algorithm>       // sort()
 using namespace std;
 #ifdef _WIN32
 #include <winsock2.h>
@@ -34,6 +35,9 @@ using namespace std;
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>        // signal()
+#include <fcntl.h>         // open()
+#include <sys/stat.h>      // stat(), fstat()
+#include <sys/mman.h>      // mmap(), munmap()
 #include <sys/types.h>     // u_short
 #include <sys/socket.h>    // socket API, setsockopt(), getsockname()
 #include <netinet/in.h>
@@ -53,6 +57,10 @@ imgdb()
   IDrange[IMGDB_IDREND] = 0;
   nimages = 0;
   bloomfilter = 0L;
+  idx = NULL;
+  nidx = 0;
+  idxmap = NULL;
+  idxmapsize = 0;
 
   sd = socks_servinit((char *) "imgdb", &self, sname);
 }
@@ -95,6 +103,32 @@ args(int argc, char *argv[])
   return(0);
 }
 
+/*
+ * addimg:
+ * add the image "fname" to db without checking that it exists.
+ * "md" is the SHA1 output computed over fname and 
+ * "id" is the id computed from md.
+ * The Bloom Filter is also updated after the image is added.
+*/
+void imgdb::
+addimg(unsigned char id, unsigned char *md, char *fname)
+{
+  /* store the image name, without the folder name, into the database */
+  strcpy(db[nimages].img_name, fname);
+
+  /* store its ID also */
+  db[nimages].img_ID = id;
+
+  /* update the bloom filter to record the presence of the 
+     image in the DB. The function bfIDX() is defined in hash.cpp. */
+  bloomfilter |= (1L << (int) bfIDX(BFIDX1, md)) |
+    (1L << (int) bfIDX(BFIDX2, md)) | (1L << (int) bfIDX(BFIDX3, md));
+
+  nimages++;
+
+  return;
+}
+
 /*
  * loadimg:
  * load the image associate with "fname" into db.
@@ -117,35 +151,162 @@ loadimg(unsigned char id, unsigned char *md, char *fname)
   net_assert(img_fs.fail(), "imgdb::loadimg: fail to open image file");
   img_fs.close();
 
-  /* if the file can be opened, store the image name, without the folder name,
-     into the database */
-  strcpy(db[nimages].img_name, fname);
+  /* if the file can be opened, add it to the database */
+  addimg(id, md, fname);
 
-  /* store its ID also */
-  db[nimages].img_ID = id;
+  return;
+}
 
-  /* update the bloom filter to record the presence of the 
-     image in the DB. The function bfIDX() is defined in hash.cpp. */
-  bloomfilter |= (1L << (int) bfIDX(BFIDX1, md)) |
-    (1L << (int) bfIDX(BFIDX2, md)) | (1L << (int) bfIDX(BFIDX3, md));
+static bool
+imgdb_idxcmp(const imgidx_t &a, const imgidx_t &b)
+{
+  return(a.img_ID < b.img_ID);
+}
 
-  nimages++;
+/*
+ * checkidx: check the index entry "ent" against its image file.
+ * If the file has been modified since it was last checked, update
+ * its size and TGA format in the index.  Terminate process if the
+ * image file doesn't exist.
+ */
+void imgdb::
+checkidx(imgidx_t *ent)
+{
+  string pathname;
+  struct stat st;
+  fstream img_fs;
+  unsigned char tgahdr[18];
+  int err;
+
+  pathname = IMGDB_FOLDER;
+  pathname = pathname+IMGDB_DIRSEP+ent->img_name;
+  err = stat(pathname.c_str(), &st);
+  net_assert((err < 0), "imgdb::checkidx: fail to open image file");
+
+  if (ent->img_mtime == (int64_t) st.st_mtime &&
+      ent->img_size == (int64_t) st.st_size) {
+    return;
+  }
+
+  /* new or modified image, (re)read its TGA header */
+  ent->img_type = ent->img_depth = 0;
+  img_fs.open(pathname.c_str(), fstream::in | fstream::binary);
+  net_assert(img_fs.fail(), "imgdb::checkidx: fail to open image file");
+  img_fs.read((char *) tgahdr, sizeof(tgahdr));
+  if (img_fs.gcount() == sizeof(tgahdr)) {
+    ent->img_type = tgahdr[2];
+    ent->img_depth = tgahdr[16];
+  }
+  img_fs.close();
+
+  ent->img_mtime = (int64_t) st.st_mtime;
+  ent->img_size = (int64_t) st.st_size;
 
   return;
 }
 
 /*
- * loaddb(): load the image database with the ID and name of all
- * images whose ID are within the ID range of this node.  See inline
- * comments below
+ * unmapidx: drop the index.
  */
 void imgdb::
-loaddb()
+unmapidx()
 {
-  fstream list_fs, img_fs;
-  char fname[NETIMG_MAXFNAME];
+#ifndef _WIN32
+  if (idxmap) {
+    munmap(idxmap, idxmapsize);
+  }
+#endif
+  idxmap = NULL;
+  idxmapsize = 0;
+  idx = NULL;
+  nidx = 0;
+  idxbuf.clear();
+
+  return;
+}
+
+/*
+ * mapidx: make idx point to the entries of IMGDB_INDEX, mapped
+ * read-write so that checkidx() updates the file in place.  Returns
+ * 1 on success, 0 if there is no index or if it is stale, i.e., if
+ * IMGDB_FILELIST has changed since the index was built.
+ */
+int imgdb::
+mapidx()
+{
+#ifdef _WIN32
+  return(0);
+#else
   string pathname;
-  unsigned char id, md[SHA1_MDLEN];
+  struct stat list_st, idx_st;
+  imgidxhdr_t *hdr;
+  void *map;
+  int fd;
+
+  pathname = IMGDB_FOLDER;
+  pathname = pathname+IMGDB_DIRSEP+IMGDB_FILELIST;
+  if (stat(pathname.c_str(), &list_st) < 0) {
+    return(0);
+  }
+
+  /* already mapped and still current? */
+  hdr = (imgidxhdr_t *) idxmap;
+  if (hdr && hdr->ix_mtime == (int64_t) list_st.st_mtime &&
+      hdr->ix_size == (int64_t) list_st.st_size) {
+    return(1);
+  }
+  unmapidx();
+
+  pathname = IMGDB_FOLDER;
+  pathname = pathname+IMGDB_DIRSEP+IMGDB_INDEX;
+  fd = open(pathname.c_str(), O_RDWR);
+  if (fd < 0) {
+    return(0);
+  }
+  if (fstat(fd, &idx_st) < 0 || idx_st.st_size < (off_t) sizeof(imgidxhdr_t)) {
+    close(fd);
+    return(0);
+  }
+  map = mmap(NULL, idx_st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return(0);
+  }
+
+  hdr = (imgidxhdr_t *) map;
+  if (hdr->ix_magic != IMGDB_IDXMAGIC ||
+      hdr->ix_mtime != (int64_t) list_st.st_mtime ||
+      hdr->ix_size != (int64_t) list_st.st_size ||
+      (size_t) idx_st.st_size != sizeof(imgidxhdr_t)+hdr->ix_count*sizeof(imgidx_t)) {
+    munmap(map, idx_st.st_size);
+    return(0);
+  }
+
+  idxmap = map;
+  idxmapsize = idx_st.st_size;
+  idx = (imgidx_t *) (hdr+1);
+  nidx = hdr->ix_count;
+
+  return(1);
+#endif
+}
+
+/*
+ * buildidx: build the index of IMGDB_FILELIST from scratch, write it
+ * to IMGDB_INDEX, and map it.  If the index can't be written or
+ * mapped, idx points to an in-memory copy.
+ */
+void imgdb::
+buildidx()
+{
+  fstream list_fs, idx_fs;
+  char fname[NETIMG_MAXFNAME];
+  string pathname, idxname;
+  struct stat list_st;
+  imgidxhdr_t hdr;
+  imgidx_t ent;
+
+  unmapidx();
 
   /* IMGDB_FOLDER contains the name of the folder where the image
      files are, e.g., "images".  We assume there's a file in that
@@ -156,38 +317,116 @@ loaddb()
   */
   pathname = IMGDB_FOLDER;
   pathname = pathname+IMGDB_DIRSEP+IMGDB_FILELIST;
+  net_assert((stat(pathname.c_str(), &list_st) < 0),
+             "imgdb::buildidx: fail to open FILELIST.txt.");
   list_fs.open(pathname.c_str(), fstream::in);
-  net_assert(list_fs.fail(), "imgdb::loaddb: fail to open FILELIST.txt.");
+  net_assert(list_fs.fail(), "imgdb::buildidx: fail to open FILELIST.txt.");
 
   /* After FILELIST.txt is open for reading, we parse it one line at a
      time, each line is assumed to contain the name of one image file.
   */
-  cerr << "Loading DB IDs in (" << (int) IDrange[IMGDB_IDRBEG] <<
-    ", " << (int) IDrange[IMGDB_IDREND] << "]\n";
-  do {
+  while (1) {
     list_fs.getline(fname, NETIMG_MAXFNAME);
     if (list_fs.eof()) break;
     net_assert(list_fs.fail(),
-               "imgdb::loaddb: image file name longer than NETIMG_MAXFNAME");
+               "imgdb::buildidx: image file name longer than NETIMG_MAXFNAME");
 
     /* for each image, we compute a SHA1 of its file name, without
        the image folder path. The SHA1() function is part of the
        cryto/openssl library */
-    SHA1((unsigned char *) fname, strlen(fname), md);
+    memset(&ent, 0, sizeof(imgidx_t));
+    strcpy(ent.img_name, fname);
+    SHA1((unsigned char *) fname, strlen(fname), ent.img_md);
 
     /* from the SHA1 message digest (md), we compute an object ID */
-    id = ID(md);  // see hash.cpp
-    cerr << "  (" << setw(3) << (int) id << ") " << fname;
-
-    /* if the object ID is in the range of this node, add its ID and
-       name to the database and update the Bloom Filter. */
-    if (ID_inrange(id, IDrange[IMGDB_IDRBEG],
-                   IDrange[IMGDB_IDREND])) {  // Task 1 in hash.cpp
-      cerr << " *in range*";
-      loadimg(id, md, fname);
+    ent.img_ID = ID(ent.img_md);  // see hash.cpp
+    ent.img_mtime = -1;           // unchecked, see checkidx()
+    idxbuf.push_back(ent);
+  }
+  list_fs.close();
+
+  stable_sort(idxbuf.begin(), idxbuf.end(), imgdb_idxcmp);
+  idx = idxbuf.empty() ? NULL : &idxbuf[0];
+  nidx = idxbuf.size();
+
+  /* write to a temporary file and rename it, so that a node starting
+     concurrently never maps a partial index */
+  hdr.ix_magic = IMGDB_IDXMAGIC;
+  hdr.ix_count = nidx;
+  hdr.ix_mtime = (int64_t) list_st.st_mtime;
+  hdr.ix_size = (int64_t) list_st.st_size;
+  pathname = IMGDB_FOLDER;
+  idxname = pathname+IMGDB_DIRSEP+IMGDB_INDEX;
+  pathname = idxname+".tmp";
+  idx_fs.open(pathname.c_str(), fstream::out | fstream::trunc | fstream::binary);
+  if (idx_fs.fail()) {
+    return;
+  }
+  idx_fs.write((char *) &hdr, sizeof(imgidxhdr_t));
+  idx_fs.write((char *) idx, nidx*sizeof(imgidx_t));
+  idx_fs.close();
+  if (idx_fs.fail() || rename(pathname.c_str(), idxname.c_str()) < 0) {
+    remove(pathname.c_str());
+    return;
+  }
+
+  mapidx();  // on failure idx still points to idxbuf
+
+  return;
+}
+
+/*
+ * loaddb(): load the image database with the ID and name of all
+ * images whose ID are within the ID range of this node.
+ *
+ * Instead of parsing IMGDB_FILELIST and computing the SHA1 of every
+ * image name on every call, the names, SHA1s, and IDs are kept in a
+ * persistent index, IMGDB_INDEX, sorted by ID.  The index is rebuilt
+ * only if IMGDB_FILELIST has changed.  Otherwise only the images in
+ * range are looked at, and only to check that they still exist and
+ * to refresh their index entry if they've been modified.
+ */
+void imgdb::
+loaddb()
+{
+  int i, first, lo, hi;
+  unsigned char begin, end;
+  imgidx_t *ent;
+
+  if (!mapidx()) {
+    buildidx();
+  }
+
+  begin = IDrange[IMGDB_IDRBEG];
+  end = IDrange[IMGDB_IDREND];
+  cerr << "Loading DB IDs in (" << (int) begin << ", " << (int) end << "]\n";
+
+  /* the images in range are contiguous in idx, possibly wrapping
+     around: binary search for the first one with ID > begin */
+  first = 0;
+  if (begin != end) {
+    lo = 0; hi = nidx;
+    while (lo < hi) {
+      i = (lo+hi)/2;
+      if (idx[i].img_ID <= begin) {
+        lo = i+1;
+      } else {
+        hi = i;
+      }
     }
-    cerr << endl;
-  } while (nimages < IMGDB_MAXDBSIZE);
+    first = lo < nidx ? lo : 0;
+  }
+
+  for (i = 0; i < nidx && nimages < IMGDB_MAXDBSIZE; i++) {
+    ent = &idx[(first+i) % nidx];
+    if (!ID_inrange(ent->img_ID, begin, end)) {  // Task 1 in hash.cpp
+      break;
+    }
+    checkidx(ent);
+    cerr << "  (" << setw(3) << (int) ent->img_ID << ") " << ent->img_name
+         << " *in range*" << endl;
+    addimg(ent->img_ID, ent->img_md, ent->img_name);
+  }
 
   cerr << nimages << " images loaded." << endl;
   if (nimages == IMGDB_MAXDBSIZE) {
@@ -195,8 +434,6 @@ loaddb()
   }
   cerr << endl;
   
-  list_fs.close();
-  
   return;
 }
 
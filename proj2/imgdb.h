@@ -20,6 +20,8 @@
 #ifndef __IMGDB_H__
 #define __IMGDB_H__
 
+#include <stdint.h>
+#include <vector>
 #include "ltga.h"
 #include "netimg.h"
 #include "socks.h"
@@ -32,6 +34,8 @@
 #endif
 #define IMGDB_FOLDER    "images"
 #define IMGDB_FILELIST  "FILELIST.txt"
+#define IMGDB_INDEX     "FILELIST.idx" // persistent index of IMGDB_FILELIST
+#define IMGDB_IDXMAGIC  0x4e494458     // "NIDX"
 #define IMGDB_IDRBEG 0
 #define IMGDB_IDREND 1
 #define IMGDB_MAXDBSIZE 1024 // DB can only hold 1024 images max
@@ -46,6 +50,27 @@ typedef struct {
   unsigned char img_ID;
   char img_name[NETIMG_MAXFNAME];
 } image_t;
+
+// IMGDB_INDEX starts with an imgidxhdr_t followed by ix_count
+// imgidx_t's sorted by ID.  It is in host byte order and only ever
+// read by the node that wrote it.
+typedef struct {
+  unsigned int ix_magic;        // IMGDB_IDXMAGIC
+  unsigned int ix_count;        // number of entries
+  int64_t ix_mtime;             // of IMGDB_FILELIST when indexed
+  int64_t ix_size;              // of IMGDB_FILELIST when indexed
+} imgidxhdr_t;
+
+typedef struct {
+  unsigned char img_ID;
+  unsigned char img_type;       // TGA image type, 0 if unknown
+  unsigned char img_depth;      // TGA pixel depth, in bits
+  unsigned char img_rsvd;
+  unsigned char img_md[SHA1_MDLEN]; // SHA1 of img_name
+  int64_t img_mtime;            // of the image file when last checked
+  int64_t img_size;             // of the image file, in bytes
+  char img_name[NETIMG_MAXFNAME];
+} imgidx_t;
    
 class imgdb {
   struct sockaddr_in self;
@@ -56,6 +81,19 @@ class imgdb {
   image_t db[IMGDB_MAXDBSIZE];
   LTGA curimg;
 
+  // index of IMGDB_FILELIST, see loaddb()
+  imgidx_t *idx;                // nidx entries sorted by ID
+  int nidx;
+  void *idxmap;                 // mapping of IMGDB_INDEX, NULL if not mapped
+  size_t idxmapsize;
+  std::vector<imgidx_t> idxbuf; // holds idx if IMGDB_INDEX can't be mapped
+
+  int mapidx();
+  void unmapidx();
+  void buildidx();
+  void checkidx(imgidx_t *ent);
+  void addimg(unsigned char id, unsigned char *md, char *fname);
+
 public:
   int sd;  // image listen socket
   int td;  // image server socket generated from accept
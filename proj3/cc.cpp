@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2014, 2015 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <string.h>        // strcmp()
+#include <algorithm>       // min(), max()
+using namespace std;
+
+#include "cc.h"
+
+/*
+ * cc::onloss: halve the window, as fast recovery does.
+ */
+void cc::
+onloss()
+{
+  ssthresh = max(cwnd/2, (float) CC_MINWND);
+  cwnd = ssthresh;
+
+  return;
+}
+
+/*
+ * cc::ontimeout: remember half the window as the slow start
+ * threshold and start over from one segment.
+ */
+void cc::
+ontimeout()
+{
+  ssthresh = max(cwnd/2, (float) CC_MINWND);
+  cwnd = 1.0;
+
+  return;
+}
+
+/*
+ * cc_aimd::onack: in slow start, grow the window by one segment per
+ * segment acknowledged, doubling it every round trip; past ssthresh,
+ * by one segment per window acknowledged.
+ */
+void cc_aimd::
+onack(int acked, long rtt)
+{
+  if (cwnd < ssthresh) {
+    cwnd += acked;
+  } else {
+    cwnd += (float) acked/cwnd;
+  }
+  cwnd = min(cwnd, (float) CC_MAXWND);
+
+  return;
+}
+
+/*
+ * cc_delay::onack: keep track of the lowest RTTs.  In slow start,
+ * grow the window as cc_aimd does, until onround() finds the path
+ * starting to queue.
+ */
+void cc_delay::
+onack(int acked, long rtt)
+{
+  if (rtt > 0) {
+    basertt = basertt ? min(basertt, rtt) : rtt;
+    minrtt = minrtt ? min(minrtt, rtt) : rtt;
+  }
+  if (cwnd < ssthresh) {
+    cwnd = min(cwnd+acked, (float) CC_MAXWND);
+  }
+
+  return;
+}
+
+/*
+ * cc_delay::onround: estimate the segments queued in the path as
+ * cwnd*(1-basertt/minrtt), the difference between the window and
+ * what would be in flight without queueing.  Leave slow start at the
+ * first sign of queueing, then move cwnd by one segment towards
+ * keeping between CC_ALPHA and CC_BETA segments queued.  Rounds
+ * without an RTT sample leave cwnd alone.
+ */
+void cc_delay::
+onround()
+{
+  float queued;
+
+  if (!minrtt) {
+    return;
+  }
+  queued = cwnd*(1.0-(float) basertt/minrtt);
+  minrtt = 0;
+
+  if (cwnd < ssthresh) {
+    if (queued > CC_ALPHA) {
+      ssthresh = cwnd;
+    }
+  } else if (queued < CC_ALPHA) {
+    cwnd = min(cwnd+1, (float) CC_MAXWND);
+  } else if (queued > CC_BETA) {
+    cwnd = max(cwnd-1, (float) CC_MINWND);
+  }
+
+  return;
+}
+
+/*
+ * cc_new: returns a new congestion controller of the given "name",
+ * "aimd", "delay", or "none", or NULL if there's no such controller.
+ */
+cc *
+cc_new(const char *name)
+{
+  cc *c;
+
+  if (!strcmp(name, "aimd")) {
+    c = new cc_aimd;
+  } else if (!strcmp(name, "delay")) {
+    c = new cc_delay;
+  } else if (!strcmp(name, "none")) {
+    c = new cc_none;
+  } else {
+    return(NULL);
+  }
+  c->reset();
+
+  return(c);
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2014, 2015 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __CC_H__
+#define __CC_H__
+
+#define CC_INITWND      4.0   // initial congestion window, in segments
+#define CC_MINWND       2.0   // cwnd after a loss never goes below this
+#define CC_MAXWND     255.0   // NETIMG_MAXWIN
+#define CC_ALPHA        2.0   // delay-based: grow cwnd with fewer than
+#define CC_BETA         4.0   // CC_ALPHA segments queued in the path,
+                              // shrink it with more than CC_BETA
+
+/*
+ * Congestion control of the image sender.  The sender may have at
+ * most min(cwnd, rwnd) segments outstanding, and tells its controller
+ * about ACKs, lost segments, and retransmission timeouts.  Each
+ * controller reacts to them in its own way.
+ */
+class cc {
+public:
+  float cwnd;       // congestion window, in segments
+  float ssthresh;   // slow start threshold, in segments
+
+  cc() { reset(); }
+  virtual ~cc() {}
+  virtual const char *name() = 0;
+
+  // start over, for a new transfer
+  virtual void reset() { cwnd = CC_INITWND; ssthresh = CC_MAXWND; }
+  // "acked" segments newly acknowledged, "rtt" usecs measured, or -1
+  virtual void onack(int acked, long rtt) = 0;
+  // a segment was found lost while others got through
+  virtual void onloss();
+  // the retransmission timer expired
+  virtual void ontimeout();
+  // a round trip time has passed
+  virtual void onround() {}
+};
+
+/* slow start and congestion avoidance: additive increase of one
+   segment per round trip, multiplicative decrease on loss */
+class cc_aimd : public cc {
+public:
+  const char *name() { return "aimd"; }
+  void onack(int acked, long rtt);
+};
+
+/* delay-based, as in TCP Vegas: once per round trip, compare the
+   rate cwnd would get at the lowest RTT seen with the one it got,
+   and grow or shrink cwnd by one segment to keep between CC_ALPHA
+   and CC_BETA segments queued in the path */
+class cc_delay : public cc {
+  long basertt;     // lowest RTT seen, usecs, 0 if none yet
+  long minrtt;      // lowest RTT seen this round trip, 0 if none
+public:
+  const char *name() { return "delay"; }
+  void reset() { cc::reset(); basertt = minrtt = 0; }
+  void onack(int acked, long rtt);
+  void onround();
+};
+
+/* no congestion control, cwnd stays open at CC_MAXWND, so only rwnd
+   limits the sender */
+class cc_none : public cc {
+public:
+  const char *name() { return "none"; }
+  void reset() { cwnd = ssthresh = CC_MAXWND; }
+  void onack(int acked, long rtt) {}
+  void onloss() {}
+  void ontimeout() {}
+};
+
+extern cc *cc_new(const char *name);
+
+#endif // __CC_H__
@@ -21,8 +21,10 @@
 #include <stdlib.h>        // atoi(), random()
 #include <assert.h>        // assert()
 #include <limits.h>        // LONG_MAX, INT_MAX
+#include <errno.h>         // errno, EBADF, ENOTSOCK
 #include <iostream>
 #include <algorithm>
+#include <map>
 using namespace std;
 #ifdef _WIN32
 #include <winsock2.h>
@@ -38,6 +40,10 @@ using namespace std;
 #include <sys/types.h>     // u_short
 #include <sys/socket.h>    // socket API, setsockopt(), getsockname()
 #include <sys/ioctl.h>     // ioctl(), FIONBIO
+#include <sys/time.h>      // gettimeofday()
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>     // epoll_create1(), epoll_wait()
 #endif
 #ifdef __APPLE__
 #include <OpenGL/gl.h>
@@ -56,7 +62,10 @@ using namespace std;
  *
  * Returns 0 on success or 1 on failure.  On successful return,
  * the provided drop probability is copied to memory pointed to by
- * "pdrop", which must be allocated by caller.  
+ * "cfg.pdrop", the retransmission scheme, "gbn" or "sr", to
+ * "cfg.arq", the name of the congestion controller, "aimd", "delay",
+ * or "none", to "cfg.ccname", and the number of duplicate ACKs that
+ * trigger fast retransmit, 0 to disable it, to "cfg.dupthresh".
  *
  * Nothing else is modified.
  */
@@ -65,37 +74,62 @@ args(int argc, char *argv[])
 {
   char c;
   extern char *optarg;
+  cc *newcc;
 
   if (argc < 1) {
     return (1);
   }
   
-  while ((c = getopt(argc, argv, "d:")) != EOF) {
+  while ((c = getopt(argc, argv, "d:a:c:f:")) != EOF) {
     switch (c) {
     case 'd':
-      pdrop = atof(optarg);
-      if (pdrop > 0.0 && (pdrop > NETIMG_MAXPROB || pdrop < NETIMG_MINPROB)) {
+      cfg.pdrop = atof(optarg);
+      if (cfg.pdrop > 0.0 && (cfg.pdrop > NETIMG_MAXPROB || cfg.pdrop < NETIMG_MINPROB)) {
         fprintf(stderr, "%s: recommended drop probability between %f and %f.\n", argv[0], NETIMG_MINPROB, NETIMG_MAXPROB);
       }
       break;
+    case 'a':
+      if (!strcmp(optarg, "gbn")) {
+        cfg.arq = IMGDB_GBN;
+      } else if (!strcmp(optarg, "sr")) {
+        cfg.arq = IMGDB_SR;
+      } else {
+        return(1);
+      }
+      break;
+    case 'c':
+      if (!(newcc = cc_new(optarg))) {
+        return(1);
+      }
+      delete newcc;  // each Flow gets its own, see Flow::startdata()
+      cfg.ccname = optarg;
+      break;
+    case 'f':
+      cfg.dupthresh = atoi(optarg);
+      if (cfg.dupthresh < 0) {
+        return(1);
+      }
+      break;
     default:
       return(1);
       break;
     }
   }
 
-  srandom(NETIMG_SEED+(int)(pdrop*1000));
+  srandom(NETIMG_SEED+(int)(cfg.pdrop*1000));
 
   return (0);
 }
 
 /*
- * readimg: load TGA image from file "imgname" to curimg.
+ * readimg: load TGA image from file "imgname" to curimg.  If there is
+ * a ready-to-serve container "imgname".pak made by imgpak, it is
+ * loaded instead.  Uncompressed images are memory mapped.
  * "imgname" must point to valid memory allocated by caller.
  * Terminate process on encountering any error.
  * Returns NETIMG_FOUND if "imgname" found, else returns NETIMG_NFOUND.
  */
-char imgdb::
+char Flow::
 readimg(char *imgname, int verbose)
 {
   string pathname=IMGDB_FOLDER;
@@ -104,7 +138,10 @@ readimg(char *imgname, int verbose)
     return(NETIMG_ENAME);
   }
   
-  curimg.LoadFromFile(pathname+IMGDB_DIRSEP+imgname);
+  pathname = pathname+IMGDB_DIRSEP+imgname;
+  if (!curimg.LoadFromFile(pathname+LTGA_PAKEXT, lfMapped)) {
+    curimg.LoadFromFile(pathname, lfMapped);
+  }
 
   if (!curimg.IsLoaded()) {
     return(NETIMG_NFOUND);
@@ -132,7 +169,7 @@ readimg(char *imgname, int verbose)
  *
  * Terminate process on encountering any error.
  */
-double imgdb::
+double Flow::
 marshall_imsg(imsg_t *imsg)
 {
   int alpha, greyscale;
@@ -153,24 +190,19 @@ marshall_imsg(imsg_t *imsg)
 }
 
 /* 
- * recvqry: receives an iqry_t packet and stores the client's address
- * and port number in the imgdb::client member variable.  Checks that
- * the incoming iqry_t packet is of version NETIMG_VERS and of type
- * NETIMG_SYNQRY.
+ * checkqry: checks that the "len"-byte packet "iqry" is an iqry_t
+ * packet of version NETIMG_VERS and of type NETIMG_SYNQRY, asking
+ * for segments and windows the server can send.
  *
- * If error encountered when receiving packet or if packet is of the
- * wrong version or type returns appropriate NETIMG error code.
- * Otherwise returns 0.
+ * If the packet is of the wrong size, version, or type returns
+ * appropriate NETIMG error code.  Otherwise returns 0.
  *
  * Nothing else is modified.
 */
 char imgdb::
-recvqry(int sd, iqry_t *iqry)
+checkqry(iqry_t *iqry, int len)
 {
-  int len = sizeof(struct sockaddr_in);
-  int bytes = recvfrom(sd, iqry, sizeof(iqry_t), 0, (struct sockaddr*)&client, (socklen_t *)&len);
- 
-  if (bytes != sizeof(iqry_t)) {
+  if (len != sizeof(iqry_t)) {
     return(NETIMG_ESIZE);
   }
   if (iqry->iq_vers != NETIMG_VERS) {
@@ -179,367 +211,1041 @@ recvqry(int sd, iqry_t *iqry)
   if (iqry->iq_type != NETIMG_SYNQRY) {
     return(NETIMG_ETYPE);
   }
-  if (strlen((char *) iqry->iq_name) >= NETIMG_MAXFNAME) {
+  if (strnlen((char *) iqry->iq_name, NETIMG_MAXFNAME) >= NETIMG_MAXFNAME) {
     return(NETIMG_ENAME);
   }
+  if (ntohs(iqry->iq_mss) < NETIMG_MINSS || !iqry->iq_rwnd || !iqry->iq_fwnd) {
+    return(NETIMG_ESIZE);
+  }
 
   return(0);
 }
   
+/*
+ * imgdb_usecs: returns the microseconds from "from" to "to".
+ */
+static long
+imgdb_usecs(struct timeval *from, struct timeval *to)
+{
+  return((to->tv_sec-from->tv_sec)*1000000L+(to->tv_usec-from->tv_usec));
+}
+
+/*
+ * rttinit: start with the retransmission timeout of NETIMG_SLEEP
+ * secs and NETIMG_USLEEP usecs, until the client's ACKs tell.
+ */
+void Flow::
+rttinit()
+{
+  srtt = rttvar = 0;
+  rto = NETIMG_SLEEP*1000000L+NETIMG_USLEEP;
+
+  return;
+}
+
+/*
+ * rttupdate: fold RTT sample "r", in usecs, into the smoothed RTT and
+ * its variation, and recompute the retransmission timeout from them,
+ * undoing any backoff, as in RFC 6298, but bounded by IMGDB_MINRTO and
+ * IMGDB_MAXRTO.  By Karn's rule, callers take samples only of packets
+ * sent once.
+ */
+void Flow::
+rttupdate(long r)
+{
+  if (!srtt) {
+    srtt = max(r, 1L);
+    rttvar = r/2;
+  } else {
+    rttvar = (3*rttvar+labs(srtt-r))/4;
+    srtt = (7*srtt+r)/8;
+  }
+  rto = srtt+max((long) IMGDB_RTTGRAN, 4*rttvar);
+  rto = min(max(rto, (long) IMGDB_MINRTO), (long) IMGDB_MAXRTO);
+
+  return;
+}
+
+/*
+ * rttbackoff: double the retransmission timeout, up to IMGDB_MAXRTO,
+ * after it expired.
+ */
+void Flow::
+rttbackoff()
+{
+  rto = min(2*rto, (long) IMGDB_MAXRTO);
+  fprintf(stderr, "imgdb: RTO backed off to %ld ms\n", rto/1000);
+
+  return;
+}
+
 /* 
- * sendpkt: sends the provided "pkt" of size "size"
- * to imgdb::client using sendto() and wait for an ACK packet.
- * If ACK doesn't return before retransmission timeout,
- * re-send the packet.  Keep on trying for NETIMG_MAXTRIES times.
+ * sendpkt: sends the imsg or NETIMG_FIN packet "pkt" of size "size"
+ * to the client using sendto() and notes when.  If its ACK doesn't
+ * return before the retransmission timeout, rto, Flow::timeout()
+ * sends it again, backing off rto, for up to NETIMG_MAXTRIES times.
+ * An ACK to the first try is an RTT sample, see Flow::recvack().
  *
- * Upon success, i.e., pkt sent without error and ACK returned,
- * the ACK pkt is stored in the provided "ack" variable, which
- * memory must have been allocated by caller and return the
- * return value of sendto(). Otherwise, return 0 if ACK not
- * received or if the received ACK packet is malformed.
+ * On error, the errno is kept in "err", nothing more is sent to the
+ * client, and -1 is returned; the caller ends the Flow, see
+ * imgdb::senderr().  Otherwise returns the bytes sent.
+*/
+int Flow::
+sendpkt(int sd, void *pkt, int size)
+{
+  int bytes;
+
+  if (err) {
+    return(-1);
+  }
+  bytes = sendto(sd, (char *) pkt, size, 0, (struct sockaddr*)&client,
+                 sizeof(struct sockaddr_in));
+  if (bytes < 0) {
+    err = errno;
+    return(-1);
+  }
+  gettimeofday(&sent, NULL);
+  tries++;
+
+  return(bytes);
+}
+
+/*
+ * queuepkt: queue a packet of type "type" and sequence number "seqn",
+ * carrying "size" bytes of "data", to be sent to the client with the
+ * next train, see Flow::sendtrain().  A full train, or one ending in
+ * a packet shorter than the others, is sent first.
+ */
+void Flow::
+queuepkt(int sd, unsigned char type, unsigned int seqn, const void *data, int size)
+{
+  ihdr_t *h;
+  struct iovec *iov;
+
+  if (ntrain == trainmax ||
+      (ntrain && (int) (tiov[ntrain*NETIMG_NUMIOV-1].iov_len+sizeof(ihdr_t)) < dgsize)) {
+    sendtrain(sd);
+  }
+
+  h = &hdrs[ntrain];
+  iov = &tiov[ntrain*NETIMG_NUMIOV];
+  h->ih_vers = NETIMG_VERS;
+  h->ih_type = type;
+  h->ih_size = htons(size);
+  h->ih_seqn = htonl(seqn);
+  iov[0].iov_base = h;
+  iov[0].iov_len = sizeof(ihdr_t);
+  iov[1].iov_base = (void *) data;
+  iov[1].iov_len = size;
+  ntrain++;
+
+  return;
+}
+
+/*
+ * sendtrain: send the packets queued by Flow::queuepkt(), all but
+ * the last one of dgsize bytes, with one system call if possible, see
+ * socks_sendsegs().  Empties the queue.
  *
- * Nothing else is modified.
+ * On error, as Flow::sendpkt(), returns -1, else 0.
 */
-int imgdb::
-sendpkt(int sd, char *pkt, int size, ihdr_t *ack)
+int Flow::
+sendtrain(int sd)
 {
-  /* PA3 Task 2.1: sends the provided pkt to client as you did in
-   * Lab5.  In addition, initialize a struct timeval timeout variable
-   * to NETIMG_SLEEP sec and NETIMG_USLEEP usec and wait for read
-   * event on socket sd up to the timeout value.  If no read event
-   * occurs before the timeout, try sending the packet to client
-   * again.  Repeat NETIMG_MAXTRIES times.  If read event occurs
-   * before timeout, receive the incoming packet and make sure that it
-   * is an ACK pkt as expected.
-   */
-  /* PA3: YOUR CODE HERE */
+  if (ntrain && !err && socks_sendsegs(sd, &mh, ntrain, dgsize, &gso) < 0) {
+    err = errno;
+  }
+  ntrain = 0;
 
-  fd_set rset;
-  struct timeval tv;
-  FD_ZERO(&rset);
-  FD_SET(sd, &rset);  
-  socklen_t len=sizeof(struct sockaddr_in);
+  return(err ? -1 : 0);
+}
 
-  int try_count=0;
-  while(try_count<NETIMG_MAXTRIES)
+/*
+ * sendseg: send the segment at offset "off" of the image, "segsize"
+ * bytes long, unless it is probabilistically dropped, and note when
+ * it was sent, see Flow::markack().  "una" is the first offset not
+ * acknowledged, for the log.
+ */
+void Flow::
+sendseg(int sd, unsigned int off, int segsize, unsigned int una)
+{
+  int seg = off/datasize;
+
+  gettimeofday(&segsent[seg], NULL);
+  if (segtries[seg] < UCHAR_MAX)
+    segtries[seg]++;
+  sndhigh = max(sndhigh, off+segsize);
+
+  /* probabilistically drop a segment */
+  if(((float) random())/INT_MAX < cfg.pdrop)
+    fprintf(stderr, "imgdb_sendimg: DROPPED offset 0x%x, %d bytes\n", off, segsize);
+  else
   {
-    int bytes = sendto(sd, pkt, size, 0, (struct sockaddr*)&client, len);
-    net_assert((bytes<0), "imgdb_sendpkt: send error"); 
+    queuepkt(sd, NETIMG_DATA, off, ip+off, segsize);
+    fprintf(stderr, "imgdb_sendimg: sent offset 0x%x, %d bytes, unacked: 0x%x\n", off, segsize, una);
+  }
 
-    tv.tv_sec = NETIMG_SLEEP;
-    tv.tv_usec = NETIMG_USLEEP;
-    select(sd+1, &rset, NULL, NULL, &tv);
-    if(FD_ISSET(sd, &rset))
-    {
-      int err=recvfrom(sd, ack, sizeof(ihdr_t), 0, (struct sockaddr*)&client, &len);
-      net_assert(err<0, "imgdb_sendpkt: recv error");
-      if(ack->ih_vers == NETIMG_VERS && ack->ih_type == NETIMG_ACK)
+  return;
+}
+
+/*
+ * sendfec: send FEC packet "fec" of the "count" segments ending at
+ * offset "seqn", unless it is probabilistically dropped.  If "fec" is
+ * to be reused for the next FEC window, it is sent right away.
+ */
+void Flow::
+sendfec(int sd, unsigned int seqn, const unsigned char *fec, int count, bool reused)
+{
+  /* probabilistically drop a FEC packet */
+  if (((float) random())/INT_MAX < cfg.pdrop)
+    fprintf(stderr, "imgdb_sendimg: DROPFEC offset 0x%x, segment count: %d bytes\n", seqn, count);
+  else
+  {
+    queuepkt(sd, NETIMG_FEC, seqn, fec, datasize);
+    if (reused)
+      sendtrain(sd);
+    fprintf(stderr, "imgdb_sendimg: sent FEC offset 0x%x, segment count: %d\n", seqn, count);
+  }
+
+  return;
+}
+
+/*
+ * markack: take in "ack", with ih_seqn in host byte order, the header
+ * of the "len"-byte ACK packet "pkt".  Segments the ACK covers,
+ * cumulatively or in a SACK bitmap following it, are marked in
+ * "sacked".  The newest segment an ACK covers for the first time is
+ * an RTT sample, unless it was resent.  ACKs that repeat the
+ * cumulative ACK while data is outstanding are counted in "dupacks".
+ * The congestion controller is told about the segments newly
+ * acknowledged, and, once per round trip, that one has passed; cwnd
+ * is then logged.  Returns the number of segments newly marked.
+ */
+int Flow::
+markack(ihdr_t *ack, unsigned char *pkt, int len)
+{
+  int sacklen, i, n = 0;
+  int newest = -1;  // newest segment covered
+  long rtt = -1;
+  unsigned int seg;
+  struct timeval now;
+
+  if (ack->ih_seqn > ackhigh && (long) ack->ih_seqn <= img_size)
+  {
+    for (seg = ackhigh/datasize; seg*datasize < ack->ih_seqn; seg++)
+      if (!sacked[seg])
       {
-        ack->ih_seqn = ntohl(ack->ih_seqn);
-        return (bytes);
+        sacked[seg] = 1;
+        newest = (int) seg;
+        n++;
       }
-    }
-    try_count++;
+    ackhigh = ack->ih_seqn;
+    dupacks = 0;
   }
-  return(0);
+  else if (ack->ih_seqn == ackhigh && ackhigh < sndhigh)
+    dupacks++;  // the client is missing the segment at ackhigh
+
+  /* a SACK bitmap follows if the ACK is longer than ihdr_t,
+     clients that don't SACK send bare ihdr_t's */
+  sacklen = len-(int)sizeof(ihdr_t);
+  if (sacklen > 0 && ntohs(ack->ih_size) == sacklen)
+  {
+    seg = ack->ih_seqn/datasize+1;
+    for (i = 0; i < sacklen*8; i++)
+      if ((pkt[sizeof(ihdr_t)+i/8] >> (i%8)) & 1 &&
+          (long) (seg+i)*datasize < img_size &&
+          !sacked[seg+i])
+      {
+        sacked[seg+i] = 1;
+        newest = max(newest, (int) (seg+i));
+        n++;
+      }
+  }
+  while (base < nsegs && sacked[base])
+    base++;
+
+  if (newest >= 0 && segtries[newest] == 1)
+  {
+    gettimeofday(&now, NULL);
+    rtt = imgdb_usecs(&segsent[newest], &now);
+    rttupdate(rtt);
+  }
+  if (n)
+    cong->onack(n, rtt);
+
+  /* a round trip has passed once everything sent at the start of
+     the last one is acknowledged */
+  if (ackhigh >= rndmark)
+  {
+    cong->onround();
+    rndmark = max(sndhigh, ackhigh+1);
+    fprintf(stderr, "imgdb_sendimg: %s cwnd %.1f, ssthresh %.1f, srtt %ld us, rto %ld ms\n",
+            cong->name(), cong->cwnd, cong->ssthresh, srtt, rto/1000);
+  }
+
+  return(n);
 }
 
 /*
- * sendimg:
- * Send the image contained in *image to the client pointed to by
- * *client. Send the image in chunks of segsize, not to exceed mss,
- * instead of as one single image. With probability pdrop, drop a
- * segment instead of sending it.  Lab6 and PA3: compute and send an
- * accompanying FEC packet for every "fwnd"-full of data.
- *
- * PA3: If received malformed ACK to imsg, assume client has exited,
- * and simply return to caller.
+ * fastrexmit: once "dupthresh" duplicate ACKs have arrived, the
+ * segment at ackhigh is taken as lost, since the client has received
+ * segments after it.  Resend it right away, rather than wait for the
+ * RTO, and tell the congestion controller.  Called after each ACK;
+ * acts only on the ACK that reaches "dupthresh".  Returns the number
+ * of segments resent, 0 or 1, for Go-Back-N to charge to "usable".
+ */
+int Flow::
+fastrexmit(int sd)
+{
+  if (!cfg.dupthresh || dupacks != cfg.dupthresh || (long) ackhigh >= img_size)
+    return(0);
+
+  fprintf(stderr, "imgdb_sendimg: %d dup acks, fast retransmit offset 0x%x\n",
+          dupacks, ackhigh);
+  sendseg(sd, ackhigh, min((long) datasize, img_size-(long) ackhigh), ackhigh);
+  sendtrain(sd);
+  cong->onloss();
+
+  return(1);
+}
+
+/*
+ * init: start serving client "from" its query "iqry", with the
+ * server's settings "c": load the queried image and send the client
+ * an imsg describing it, or telling it why not.  Once the client
+ * ACKs the imsg, Flow::startdata() begins sending the image.
+ */
+void Flow::
+init(int sd, struct sockaddr_in *from, iqry_t *iqry, imgcfg *c)
+{
+  double imgdsize;
+
+  client = *from;
+  cfg = *c;
+  err = 0;
+  gso = 1;
+  ntrain = 0;
+  tries = 0;
+  gettimeofday(&heard, NULL);
+  rttinit();
+
+  memset(&imsg, 0, sizeof(imsg_t));
+  imsg.im_type = readimg(iqry->iq_name, 1);
+  if (imsg.im_type == NETIMG_FOUND) 
+  {
+    mss = (unsigned short) ntohs(iqry->iq_mss);
+    // Lab6:
+    rwnd = iqry->iq_rwnd;
+    fwnd = iqry->iq_fwnd;
+
+    imgdsize = marshall_imsg(&imsg);
+    net_assert((imgdsize > (double) LONG_MAX),
+               "imgdb: image too big");
+    ip = (unsigned char *) curimg.GetPixels();
+    img_size = (long) imgdsize;
+  }
+
+  /* Prepare imsg for transmission: fill in im_vers and convert
+   * integers to network byte order before transmission.  Send the
+   * imsg packet by calling Flow::sendpkt().
+   */
+  imsg.im_vers = NETIMG_VERS;
+  imsg.im_width = htons(imsg.im_width);
+  imsg.im_height = htons(imsg.im_height);
+  imsg.im_format = htons(imsg.im_format);
+
+  state = IMGDB_IMSG;
+  sendpkt(sd, &imsg, sizeof(imsg_t));
+
+  return;
+}
+
+/*
+ * startdata: the client has ACKed the imsg; get ready to send it the
+ * image in chunks of segsize, not to exceed mss, instead of as one
+ * single image, see Flow::send().
  *
  * Terminate process upon encountering any error.
- * Doesn't otherwise modify anything.
-*/
-void imgdb::
-sendimg(int sd, imsg_t *imsg, unsigned char *image, long img_size, int numseg)
+ */
+void Flow::
+startdata(int sd)
 {
-  int left, bytes, segsize;
-  unsigned char *ip;
-  ihdr_t ack;
-  /* Prepare imsg for transmission: fill in im_vers and convert
-   * integers to network byte order before transmission.  Note that
-   * im_type is set by the caller and should not be modified.  Send
-   * the imsg packet by calling imgdb::sendpkt().
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  nsegs = (img_size+datasize-1)/datasize;
+
+  /* Segments and FEC packets are queued and sent out in trains
+   * of up to trainmax datagrams of dgsize bytes, so that where
+   * the kernel can split a train into datagrams itself, each
+   * train costs one system call, see Flow::queuepkt().
    */
-  imsg->im_vers = NETIMG_VERS;
-  imsg->im_width = htons(imsg->im_width);
-  imsg->im_height = htons(imsg->im_height);
-  imsg->im_format = htons(imsg->im_format);
-
-  // send the imsg packet to client by calling sendpkt().
-  bytes = sendpkt(sd, (char *) imsg, sizeof(imsg_t), &ack);
-  if ((bytes != sizeof(imsg_t)) || (ack.ih_seqn != NETIMG_SYNSEQ)) 
-  {
-    fprintf(stderr, "sendpkt failed");
-    return;
-  }
+  dgsize = sizeof(ihdr_t)+datasize;
+  trainmax = gso ? max(1, min(SOCKS_GSOSEGS, SOCKS_GSOSIZE/dgsize)) : 1;
+  ntrain = 0;
 
-  if (image) 
-  {
-    ip = image; /* ip points to the start of image byte buffer */
-    int datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  mh.msg_name = &client;
+  mh.msg_namelen = sizeof(struct sockaddr_in);
+  mh.msg_iov = tiov;
+  mh.msg_iovlen = NETIMG_NUMIOV;
+  mh.msg_control = NULL;
+  mh.msg_controllen = 0; 
 
-    unsigned int snd_next=0;
-    int fec_count=0; // how many segmants in this fec block has sent
+  /* SACK scoreboard: per segment, whether the client has reported
+   * it received, cumulatively or beyond the cumulative ACK.  Such
+   * segments are not resent after an RTO, but are still folded
+   * into the FEC of their window.  FEC windows always start on a
+   * multiple of fwnd segments, so that the client can tell which
+   * window an FEC packet is for. */
+  sacked = (unsigned char *) calloc(img_size/datasize+1, 1);
+  segsent = (struct timeval *) calloc(img_size/datasize+1, sizeof(struct timeval));
+  segtries = (unsigned char *) calloc(img_size/datasize+1, 1);
+  fec = (unsigned char *) malloc(datasize);
+  net_assert((sacked == NULL || segsent == NULL || segtries == NULL || fec == NULL),
+             "imgdb_sendimg: calloc");
+  ackhigh = 0;
+  dupacks = 0;
+  sndhigh = rndmark = 0;
+  cong = cc_new(cfg.ccname);
 
-    /* Lab5 Task 1:
-     * make sure that the send buffer is of size at least mss.
-     */
-    /* Lab5: YOUR CODE HERE */
-    int bufsize = (int)mss;
-    setsockopt(sd, SOL_SOCKET,SO_SNDBUF,&bufsize,sizeof(int));
+  /* If the image came with precomputed parity for this mss and
+   * fwnd, FEC windows that start on a multiple of fwnd segments
+   * use it instead of accumulating FEC.  Parity computed for
+   * another segment layout is ignored, see LTGA::GetParity(). */
+  parity = curimg.GetParity(mss, datasize, fwnd);
+  fecpre = NULL;
 
-    /* Lab5 Task 1:
-     *
-     * Populate a struct msghdr with information of the destination
-     * client, a pointer to a struct iovec array.  The iovec array
-     * should be of size NETIMG_NUMIOV.  The first entry of the iovec
-     * should be initialized to point to an ihdr_t, which should be
-     * re-used for each chunk of data to be sent.
-     */
-    /* Lab5: YOUR CODE HERE */
-    ihdr_t ihdr;
-    ihdr.ih_vers = NETIMG_VERS;
-    ihdr.ih_type = NETIMG_DATA;
-
-    struct iovec iov[NETIMG_NUMIOV];
-    iov[0].iov_base = &ihdr;
-    iov[0].iov_len = sizeof(ihdr_t);
-    struct msghdr mh;
-    mh.msg_name = &client;
-    mh.msg_namelen = sizeof(struct sockaddr_in);
-    mh.msg_iov = iov;
-    mh.msg_iovlen = NETIMG_NUMIOV;
-    mh.msg_control = NULL;
-    mh.msg_controllen = 0; 
-
-    /* PA3 Task 2.2 and Task 4.1: initialize any necessary variables
-     * for your sender side sliding window and FEC window.
-     */
-    /* PA3: YOUR CODE HERE */
-    unsigned char FEC[datasize]; // FEC window 
-    unsigned int window_base=0;
-    int usable=rwnd;
+  /* PA3 Task 2.2 and Task 4.1: initialize any necessary variables
+   * for your sender side sliding window and FEC window.
+   */
+  snd_next = 0;
+  window_base = 0;
+  wnd = usable = min((int) cong->cwnd, (int) rwnd);
+  fec_count = 0;
+  fec_sent = 0;
+
+  srwnd = max(1, rwnd-rwnd/(fwnd+1));
+  base = next = 0;
+
+  state = IMGDB_DATA;
+
+  return;
+}
 
-    do 
+/*
+ * sendgbn: send the client a usable window-full of the image, each
+ * segment, with probability pdrop, dropped instead of sent.  Lab6
+ * and PA3: compute and send an accompanying FEC packet for every
+ * "fwnd"-full of data.  Segments the client already has are skipped,
+ * but still go into their window's FEC.
+ */
+void Flow::
+sendgbn(int sd)
+{
+  int left, segsize;
+
+  /* PA3 Task 2.2: Send one usable window-full of data to client.
+   * Don't forget to decrement your "usable" even if you drop a
+   * packet.
+   *
+   * PA3 Task 4.1: Before you send out each segment, update your
+   * FEC variables and initialize or accumulate your FEC data
+   * packet.  After you send out each segment, if you have
+   * accumulated an FEC window full of segments or the last segment
+   * has been sent, send your FEC data, also probabilistically
+   * dropped.  Don't forget to decrement your "usable" regardless
+   * of whether your FEC data is dropped.
+   */
+  while(usable>0)
+  {
+    if(fec_count<fwnd && (int)snd_next<img_size)
     {
-      /* PA3 Task 2.2: estimate the receiver's receive buffer based on packets
-       * that have been sent and ACKed, including outstanding FEC packet(s).
-       * We can only send as much as the receiver can buffer.
-       * It's an estimate, so it doesn't have to be exact, being off by
-       * one or two packets is fine.
-       */
-      /* PA3: YOUR CODE HERE */
-      
-      /* PA3 Task 2.2: Send one usable window-full of data to client
-       * using sendmsg() to send each segment as you did in Lab5.  As
-       * in Lab 5, you probabilistically drop a segment instead of
-       * sending it.  Basically, copy the code within the do{}while
-       * loop in imgdb::sendimg() from Lab 5 here, but put it within
-       * another loop such that a usable window-full of segments can
-       * be sent out using the Lab 5 code.  Don't forget to decrement
-       * your "usable" even if you drop a packet.
-       *
-       * PA3 Task 4.1: Before you send out each segment, update your
-       * FEC variables and initialize or accumulate your FEC data
-       * packet by copying your Lab 6 code here appropriately.
-       *
-       * PA3 Task 4.1: After you send out each segment, if you have
-       * accumulated an FEC window full of segments or the last
-       * segment has been sent, send your FEC data.  Again, copy your
-       * Lab 6 code here to the appropriate place.  You should also
-       * probabilistically drop your FEC data.  Don't forget
-       * to decrement your "usable" regardless of whether your FEC
-       * data is dropped.
-       */
-      /* PA3: YOUR CODE HERE */
-      while(usable>0)
+      left=img_size-snd_next;
+      segsize=datasize>left ? left : datasize;
+
+      if(fec_count==0)
+        fecpre = (parity && snd_next%(fwnd*datasize)==0) ?
+          parity+(snd_next/(fwnd*datasize))*datasize : NULL;
+
+      if(!fecpre)
       {
-        if(fec_count<fwnd && (int)snd_next<img_size)
-        {
-          left=img_size-snd_next;
-          segsize=datasize>left ? left : datasize;
-
-          if(fec_count>0)
-            fec_accum(FEC, ip+snd_next, datasize, (int)segsize);
-          else
-            fec_init(FEC, ip+snd_next, datasize, (int)segsize);
-
-          fec_count++;
-
-          /* probabilistically drop a segment */
-          if(((float) random())/INT_MAX < pdrop)
-            fprintf(stderr, "imgdb_sendimg: DROPPED offset 0x%x, %d bytes\n", snd_next, segsize);
-          else
-          { 
-            ihdr.ih_type = NETIMG_DATA;
-            ihdr.ih_size = htons(segsize);
-            ihdr.ih_seqn = htonl(snd_next);
-            iov[1].iov_base = ip+snd_next;
-            iov[1].iov_len = segsize;
-            if(sendmsg(sd, &mh, 0) == -1)
-            {
-              fprintf(stderr, "image socket sending error");
-              close(sd);
-              exit(1);
-            }
-            fprintf(stderr, "imgdb_sendimg: sent offset 0x%x, %d bytes, unacked: 0x%x\n", snd_next, segsize, window_base);
-          }
-
-          snd_next+=segsize;     
-          usable--;
-        }
-        else if(fec_count>0 && (fec_count==fwnd || (int)snd_next>=img_size))
-        {
-          /* probabilistically drop a FEC packet */
-          if (((float) random())/INT_MAX < pdrop)
-            fprintf(stderr, "imgdb_sendimg: DROPFEC offset 0x%x, segment count: %d bytes\n", snd_next, fec_count);
-          else
-          {
-            ihdr.ih_type = NETIMG_FEC;
-            ihdr.ih_size = htons(datasize);
-            ihdr.ih_seqn = htonl(snd_next);
-            iov[1].iov_base = FEC;
-            iov[1].iov_len = datasize;
-            if(sendmsg(sd, &mh, 0) == -1)
-            {
-              fprintf(stderr, "image socket sending error");
-              close(sd);
-              exit(1);
-            }
-            fprintf(stderr, "imgdb_sendimg: sent FEC offset 0x%x, segment count: %d\n", snd_next, fec_count);
-          }
-
-          fec_count = 0;
-          usable--;
-        }
+        if(fec_count>0)
+          fec_accum(fec, ip+snd_next, datasize, (int)segsize);
         else
-        {
-          // when fec_count is: 0, snd_next is: 0x111600, img_size is: 0x111600, enter this condition at the end of sending img
-          break;
-        }
+          fec_init(fec, ip+snd_next, datasize, (int)segsize);
       }
 
-      /* PA3 Task 2.2: Next wait for ACKs for up to NETIMG_SLEEP secs
-         and NETIMG_USLEEp usec. */
-      /* PA3: YOUR CODE HERE */
-      struct timeval tv;
-      tv.tv_sec = NETIMG_SLEEP;
-      tv.tv_usec = NETIMG_USLEEP;
-      fd_set rset;
-      FD_ZERO(&rset);
-      FD_SET(sd, &rset);      
-      
-      /* PA3 Task 2.2: If an ACK arrived, grab it off the network and slide
-       * our window forward when possible. Continue to do so for all the
-       * ACKs that have arrived.  Remember that we're using cumulative ACK.
-       *
-       * We have a blocking socket, but here we want to
-       * opportunistically grab all the ACKs that have arrived but not
-       * wait for the ones that have not arrived.  So, when we call
-       * receive, we want the socket to be non-blocking.  However,
-       * instead of setting the socket to non-blocking and then set it
-       * back to blocking again, we simply set flags=MSG_DONTWAIT when
-       * calling the receive function.
-       */
-      /* PA3: YOUR CODE HERE */
-      select(sd+1, &rset, NULL, NULL, &tv);
-      socklen_t len = sizeof(struct sockaddr_in);
-      
-      if(FD_ISSET(sd, &rset))
+      fec_count++;
+
+      if(snd_next<window_base || sacked[snd_next/datasize])
       {
-        while(1)
-        {
-          int err = recvfrom(sd, &ack, sizeof(ihdr_t), MSG_DONTWAIT, (struct sockaddr*)&client, &len);  
-          if(err == -1) 
-            break;
-          if (ack.ih_vers == NETIMG_VERS && ack.ih_type == NETIMG_ACK)
-          {
-            ack.ih_seqn=ntohl(ack.ih_seqn);
-            fprintf(stderr, "imgdb_sendimg: received ack 0x%x, unacked was 0x%x, send next 0x%x\n",
-                                              ack.ih_seqn, window_base, snd_next); 
-            window_base=max(window_base, ack.ih_seqn);
-            usable++;
-          }
-        }
+        fprintf(stderr, "imgdb_sendimg: SACKED offset 0x%x, %d bytes, not resent\n", snd_next, segsize);
+        snd_next+=segsize;
+        continue;
       }
-      
-      /* PA3 Task 2.2: If no ACK returned up to the timeout time,
-       * trigger Go-Back-N and re-send all segments starting from the
-       * last unACKed segment.
-       *
-       * PA3 Task 4.1: If you experience RTO, reset your FEC window to
-       * start at the segment to be retransmitted.
-       */
-      else
+
+      sendseg(sd, snd_next, segsize, window_base);
+      snd_next+=segsize;     
+      fec_sent++;
+      usable--;
+    }
+    else if(fec_count>0 && (fec_count==fwnd || (int)snd_next>=img_size))
+    {
+      if (fec_sent)  // else client has the whole window already
       {
-        fprintf(stderr, "imgdb_sendimg: RTO unacked 0x%x, next offset 0x%x\n", window_base, snd_next);
-        snd_next=window_base;
-        fec_count=0;
-        usable=rwnd;
+        sendfec(sd, snd_next, fecpre ? fecpre : fec, fec_count, !fecpre);
+        usable--;
       }
-       
-      /* PA3: YOUR CODE HERE */
-    } while ((int)window_base<img_size); // PA3 Task 2.2: replace the '1' with your condition for detecting 
-    // that all segments sent have been acknowledged
-    
-    /* PA3 Task 2.2: after the image is sent send a NETIMG_FIN packet
-     * and wait for ACK, using imgdb::sendpkt().
-     */
-    /* PA3: YOUR CODE HERE */
-    ihdr.ih_vers = NETIMG_VERS;
-    ihdr.ih_type = NETIMG_FIN;
-    ihdr.ih_seqn = htonl(NETIMG_FINSEQ);
-    sendpkt(sd, (char*)&ihdr, sizeof(ihdr_t), &ack); 
-  }  
+      fec_count = 0;
+      fec_sent = 0;
+    }
+    else
+    {
+      // when fec_count is: 0, snd_next is: 0x111600, img_size is: 0x111600, enter this condition at the end of sending img
+      break;
+    }
+  }
+
   return;
 }
 
 /*
- * handleqry: accept connection, then receive a query packet, search
- * for the queried image, and reply to client.
+ * sendsr: send the image to the client with Selective Repeat.  Each
+ * segment has its own retransmission timer, and, when that expires,
+ * is resent alone, unless the client has acknowledged it by then,
+ * cumulatively or in a SACK bitmap; see "sacked".  New segments are
+ * sent as long as they are within srwnd segments of the first one not
+ * acknowledged, srwnd chosen so that these and their FEC packets fit
+ * the client's rwnd, and no more than cwnd of them are outstanding.
+ * The FEC packet of a window is sent once, after the window's last
+ * segment is first sent.
  */
-void imgdb::
-handleqry()
+void Flow::
+sendsr(int sd)
 {
-  iqry_t iqry;
-  imsg_t imsg;
-  double imgdsize;
+  struct timeval now;
+  bool expired;
+  int inflight;           // segments sent and not acknowledged
+  int i, segsize;
+
+  gettimeofday(&now, NULL);
 
-  imsg.im_type = recvqry(sd, &iqry);
-  if (!imsg.im_type) 
+  /* resend outstanding segments whose timers have expired */
+  expired = false;
+  for (i = base; i < next; i++)
   {
-    imsg.im_type = readimg(iqry.iq_name, 1);
-    
-    if (imsg.im_type == NETIMG_FOUND) 
+    if (!sacked[i] && imgdb_usecs(&segsent[i], &now) >= rto)
     {
-      mss = (unsigned short) ntohs(iqry.iq_mss);
-      // Lab6:
-      rwnd = iqry.iq_rwnd;
-      fwnd = iqry.iq_fwnd;
-
-      imgdsize = marshall_imsg(&imsg);
-      net_assert((imgdsize > (double) LONG_MAX),
-                 "imgdb: image too big");
-      sendimg(sd, &imsg, (unsigned char *) curimg.GetPixels(),
-              (long)imgdsize, 0);
+      segsize = min((long) datasize, img_size-(long) i*datasize);
+      fprintf(stderr, "imgdb_sendimg: RTO offset 0x%x\n", i*datasize);
+      sendseg(sd, i*datasize, segsize, base*datasize);
+      expired = true;
+    }
+  }
+  if (expired) {
+    rttbackoff();
+    cong->ontimeout();
+  }
+
+  /* send new segments, each followed, if it ends an FEC window, by
+     that window's FEC packet, while fewer than cwnd are in flight */
+  for (inflight = 0, i = base; i < next; i++)
+    if (!sacked[i])
+      inflight++;
+  for (; next < nsegs && next < base+srwnd && inflight < (int) cong->cwnd;
+       next++, inflight++)
+  {
+    segsize = min((long) datasize, img_size-(long) next*datasize);
+    if (next%fwnd == 0)
+    {
+      fecpre = parity ? parity+(next/fwnd)*datasize : NULL;
+      if (!fecpre)
+        fec_init(fec, ip+next*datasize, datasize, segsize);
+    }
+    else if (!fecpre)
+      fec_accum(fec, ip+next*datasize, datasize, segsize);
+
+    sendseg(sd, next*datasize, segsize, base*datasize);
+
+    if ((next+1)%fwnd == 0 || next+1 == nsegs)
+      sendfec(sd, min((long) (next+1)*datasize, img_size),
+              fecpre ? fecpre : fec, next%fwnd+1, !fecpre);
+  }
+
+  return;
+}
+
+/*
+ * sendfin: the whole image has been acknowledged, send the client a
+ * NETIMG_FIN packet, see Flow::sendpkt().
+ */
+void Flow::
+sendfin(int sd)
+{
+  fin.ih_vers = NETIMG_VERS;
+  fin.ih_type = NETIMG_FIN;
+  fin.ih_size = 0;
+  fin.ih_seqn = htonl(NETIMG_FINSEQ);
+  tries = 0;
+  state = IMGDB_FIN;
+  sendpkt(sd, &fin, sizeof(ihdr_t));
+
+  return;
+}
+
+/*
+ * send: move the transfer along after ACKs came in or a timer
+ * expired: send what the windows now allow, Go-Back-N, or, if arq is
+ * IMGDB_SR, Selective Repeat, see Flow::sendsr(), or, once all of the
+ * image has been acknowledged, NETIMG_FIN.
+ */
+void Flow::
+send(int sd)
+{
+  acked = false;
+  if (state != IMGDB_DATA) {
+    return;
+  }
+
+  if (cfg.arq == IMGDB_SR ? base >= nsegs : (long) window_base >= img_size) {
+    sendfin(sd);
+    return;
+  }
+
+  if (cfg.arq == IMGDB_SR) {
+    sendsr(sd);
+  } else {
+    sendgbn(sd);
+  }
+  sendtrain(sd);
+  gettimeofday(&last, NULL);
+
+  return;
+}
+
+/*
+ * recvack: take in the "len"-byte packet "pkt" the client sent.  ACKs
+ * of the imsg start the image on its way, if there is one, else end
+ * the transfer, as do ACKs of NETIMG_FIN.  ACKs of data slide the
+ * windows forward, see Flow::markack(), and may trigger a fast
+ * retransmit, see Flow::fastrexmit().  The caller then calls
+ * Flow::send() to send what the windows allow.  Anything else is
+ * ignored.
+ */
+void Flow::
+recvack(int sd, unsigned char *pkt, int len)
+{
+  ihdr_t ack;
+  struct timeval now;
+  int n, credit, newwnd, resent;
+  unsigned int fecbytes;
+
+  if (len < (int) sizeof(ihdr_t)) {
+    return;
+  }
+  memcpy(&ack, pkt, sizeof(ihdr_t));
+  if (ack.ih_vers != NETIMG_VERS || ack.ih_type != NETIMG_ACK) {
+    return;
+  }
+  ack.ih_seqn = ntohl(ack.ih_seqn);
+  gettimeofday(&now, NULL);
+  heard = now;
+
+  switch (state) {
+  case IMGDB_IMSG:
+    if (ack.ih_seqn != NETIMG_SYNSEQ) {
+      break;
+    }
+    if (tries == 1) {
+      rttupdate(imgdb_usecs(&sent, &now));
+    }
+    if (ip) {
+      startdata(sd);
     } else {
-      sendimg(sd, &imsg, NULL, 0, 0);
+      done();
+    }
+    break;
+
+  case IMGDB_DATA:
+    if ((long) ack.ih_seqn > img_size) {
+      break;  // a late ACK of the imsg
     }
+    n = markack(&ack, pkt, len);
+    fprintf(stderr, "imgdb_sendimg: received ack 0x%x, unacked was 0x%x, %d newly acked\n",
+            ack.ih_seqn, cfg.arq == IMGDB_SR ? base*datasize : window_base, n);
+    if (cfg.arq == IMGDB_SR) {
+      fastrexmit(sd);
+      break;
+    }
+
+    /* Go-Back-N: the client may ACK only every few segments, so
+       open the window by as many segments as this ACK newly
+       covers, cumulatively or as SACKed, plus the FEC packets of
+       the windows it completes, but by at least one.  The window
+       itself is the lesser of cwnd and rwnd, and moves as cwnd
+       does. */
+    credit = n;
+    fecbytes = fwnd*datasize;
+    if (ack.ih_seqn > window_base)
+    {
+      credit += ack.ih_seqn/fecbytes - window_base/fecbytes;
+      window_base = ack.ih_seqn;
+    }
+    resent = fastrexmit(sd);
+    newwnd = min((int) cong->cwnd, (int) rwnd);
+    usable += newwnd-wnd;
+    wnd = newwnd;
+    /* a fast retransmission takes up a packet of the window, as
+       every packet sendgbn() sends does */
+    usable = min(usable+max(credit, 1), wnd) - resent;
+    break;
+
+  case IMGDB_FIN:
+    if (ack.ih_seqn == NETIMG_FINSEQ) {
+      done();
+    }
+    break;
+
+  default:
+    break;
   }
-  // else ignore bad iqry packet
 
   return;
 }
 
+/*
+ * timeout: if a timer of the transfer has expired by "now", act on
+ * it.  An imsg or NETIMG_FIN not ACKed is sent again, up to
+ * NETIMG_MAXTRIES times.  Go-Back-N starts over from the first segment
+ * not acknowledged if no ACK came for an RTO since it last sent,
+ * Selective Repeat resends the segments whose own timers expired.  A
+ * client not heard from for IMGDB_MAXIDLE usecs is given up on.
+ * Returns the usecs until the next timer expires, or -1 if the
+ * transfer is over.
+ */
+long Flow::
+timeout(int sd, struct timeval *now)
+{
+  long usecs, idle;
+  int i;
+
+  if (state == IMGDB_IDLE) {
+    return(-1);
+  }
+  idle = IMGDB_MAXIDLE-imgdb_usecs(&heard, now);
+  if (idle <= 0) {
+    fprintf(stderr, "imgdb: %s:%d silent, transfer given up\n",
+            inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+    done();
+    return(-1);
+  }
+
+  switch (state) {
+  case IMGDB_IMSG:
+  case IMGDB_FIN:
+    usecs = rto-imgdb_usecs(&sent, now);
+    if (usecs <= 0) {
+      rttbackoff();
+      if (tries >= NETIMG_MAXTRIES) {
+        if (state == IMGDB_IMSG) {
+          fprintf(stderr, "imgdb: %s:%d didn't ACK imsg\n",
+                  inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+        }
+        done();
+        return(-1);
+      }
+      if (state == IMGDB_IMSG) {
+        sendpkt(sd, &imsg, sizeof(imsg_t));
+      } else {
+        sendpkt(sd, &fin, sizeof(ihdr_t));
+      }
+      usecs = rto;
+    }
+    break;
+
+  case IMGDB_DATA:
+    if (cfg.arq == IMGDB_SR) {
+      /* the earliest retransmission timer */
+      usecs = rto;
+      for (i = base; i < next; i++)
+        if (!sacked[i])
+          usecs = min(usecs, rto-imgdb_usecs(&segsent[i], now));
+      if (usecs <= 0) {
+        send(sd);
+        usecs = rto;
+      }
+      break;
+    }
+
+    /* PA3 Task 2.2: If no ACK returned up to the timeout time,
+     * trigger Go-Back-N and re-send all segments starting from the
+     * last unACKed segment.
+     *
+     * PA3 Task 4.1: If you experience RTO, restart at the FEC window
+     * holding the segment to be retransmitted; segments before it
+     * are skipped, but go into the FEC again.
+     */
+    usecs = rto-imgdb_usecs(&last, now);
+    if (usecs <= 0) {
+      fprintf(stderr, "imgdb_sendimg: RTO unacked 0x%x, next offset 0x%x\n", window_base, snd_next);
+      rttbackoff();
+      cong->ontimeout();
+      snd_next=window_base-window_base%(fwnd*datasize);
+      fec_count=0;
+      fec_sent=0;
+      usable=wnd=min((int) cong->cwnd, (int) rwnd);
+      send(sd);
+      usecs = rto;
+    }
+    break;
+
+  default:
+    usecs = -1;
+    break;
+  }
+
+  return(min(usecs, idle));
+}
+
+/*
+ * done: the transfer is over, release everything it holds.
+ */
+void Flow::
+done()
+{
+  delete cong;
+  cong = NULL;
+  free(sacked);
+  free(segsent);
+  free(segtries);
+  free(fec);
+  sacked = NULL;
+  segsent = NULL;
+  segtries = NULL;
+  fec = NULL;
+  curimg.Clear();
+  ip = NULL;
+  ntrain = 0;
+  state = IMGDB_IDLE;
+
+  return;
+}
+
+/*
+ * imgdb_key: the key of client "addr" in imgdb::clients.
+ */
+static pair<unsigned int, unsigned short>
+imgdb_key(struct sockaddr_in *addr)
+{
+  return(make_pair((unsigned int) addr->sin_addr.s_addr, addr->sin_port));
+}
+
+/*
+ * handlepkt: the "len"-byte packet "pkt" arrived from "from".  If
+ * "from" is a client being served, it's for the client's Flow, see
+ * Flow::recvack().  Otherwise, if it's a good query, start a new Flow
+ * for it.  A Flow whose sends fail is ended, see imgdb::senderr().
+ * Queries beyond IMGDB_MAXFLOW clients are told the server is busy.
+ * Returns the Flow that took an ACK and is still going, else NULL.
+ */
+Flow *imgdb::
+handlepkt(struct sockaddr_in *from, unsigned char *pkt, int len)
+{
+  map<pair<unsigned int, unsigned short>, Flow *>::iterator it;
+  iqry_t iqry;
+  imsg_t imsg;
+  Flow *f;
+  int i;
+
+  it = clients.find(imgdb_key(from));
+  if (it != clients.end()) {
+    f = it->second;
+    f->recvack(sd, pkt, len);
+    senderr(f);
+    if (f->state != IMGDB_IDLE) {
+      return(f);
+    }
+    reap(f);
+    return(NULL);
+  }
+
+  memset(&iqry, 0, sizeof(iqry_t));
+  memcpy(&iqry, pkt, min(len, (int) sizeof(iqry_t)));
+  if (checkqry(&iqry, len)) {
+    return(NULL);  // ignore bad iqry packet
+  }
+
+  if (nflows >= IMGDB_MAXFLOW) {
+    memset(&imsg, 0, sizeof(imsg_t));
+    imsg.im_vers = NETIMG_VERS;
+    imsg.im_type = NETIMG_EBUSY;
+    sendto(sd, (char *) &imsg, sizeof(imsg_t), 0, (struct sockaddr *) from,
+           sizeof(struct sockaddr_in));
+    return(NULL);
+  }
+
+  for (i = 0; flows[i].state != IMGDB_IDLE; i++);
+  f = &flows[i];
+  f->init(sd, from, &iqry, &cfg);
+  clients[imgdb_key(from)] = f;
+  nflows++;
+  fprintf(stderr, "imgdb: %s:%d queried %s, serving %d clients\n",
+          inet_ntoa(from->sin_addr), ntohs(from->sin_port), iqry.iq_name, nflows);
+  if (senderr(f)) {
+    reap(f);
+  }
+
+  return(NULL);
+}
+
+/*
+ * reap: forget Flow "f", whose transfer is over.
+ */
+void imgdb::
+reap(Flow *f)
+{
+  clients.erase(imgdb_key(&f->client));
+  nflows--;
+  fprintf(stderr, "imgdb: done with %s:%d, serving %d clients\n",
+          inet_ntoa(f->client.sin_addr), ntohs(f->client.sin_port), nflows);
+
+  return;
+}
+
+/*
+ * senderr: if sending to the client of Flow "f" failed, e.g., with
+ * EPERM from a firewall, ENETUNREACH, or ENOBUFS, end that transfer
+ * alone, leaving the caller to reap it.  Only if the image socket
+ * itself is unusable, terminate the process.  Returns whether "f" was
+ * ended.
+ */
+bool imgdb::
+senderr(Flow *f)
+{
+  if (!f->err || f->state == IMGDB_IDLE) {
+    return(false);
+  }
+  if (f->err == EBADF || f->err == ENOTSOCK) {
+    fprintf(stderr, "imgdb: image socket sending error: %s\n", strerror(f->err));
+    close(sd);
+    exit(1);
+  }
+  fprintf(stderr, "imgdb: sending to %s:%d: %s, transfer given up\n",
+          inet_ntoa(f->client.sin_addr), ntohs(f->client.sin_port),
+          strerror(f->err));
+  f->done();
+
+  return(true);
+}
+
+/*
+ * timers: act on the expired timers of all transfers, see
+ * Flow::timeout(), and forget the transfers that are over.  Returns
+ * the usecs until the next timer expires, or -1 if there is none.
+ */
+long imgdb::
+timers()
+{
+  struct timeval now;
+  long usecs, wait = -1;
+  int i;
+
+  gettimeofday(&now, NULL);
+  for (i = 0; i < IMGDB_MAXFLOW && nflows; i++) {
+    if (flows[i].state == IMGDB_IDLE) {
+      continue;
+    }
+    usecs = flows[i].timeout(sd, &now);
+    senderr(&flows[i]);
+    if (flows[i].state == IMGDB_IDLE) {
+      reap(&flows[i]);
+      continue;
+    }
+    if (wait < 0 || usecs < wait) {
+      wait = usecs;
+    }
+  }
+
+  return(wait);
+}
+
+/*
+ * serve: serve any number of clients, up to IMGDB_MAXFLOW, at once,
+ * all on the one image socket.  Wait for packets or for the earliest
+ * timer of any transfer to expire.  All packets that have arrived are
+ * handed to imgdb::handlepkt(); only then does each transfer that got
+ * ACKs send what its windows allow, so that the segments it sends go
+ * out in as few trains as possible.  On Linux the socket is watched
+ * with epoll, elsewhere with select().  Never returns.
+ */
+void imgdb::
+serve()
+{
+  struct sockaddr_in from;
+  socklen_t fromlen;
+  unsigned char pkt[sizeof(iqry_t)+sizeof(ihdr_t)+NETIMG_SACKLEN];
+  Flow *touched[IMGDB_MAXFLOW];
+  Flow *f;
+  long wait;
+  int i, n, len, ntouched;
+#ifdef __linux__
+  struct epoll_event ev;
+  int ep;
+
+  ep = epoll_create1(0);
+  net_assert((ep < 0), "imgdb_serve: epoll_create1");
+  ev.events = EPOLLIN;
+  ev.data.fd = sd;
+  n = epoll_ctl(ep, EPOLL_CTL_ADD, sd, &ev);
+  net_assert((n < 0), "imgdb_serve: epoll_ctl");
+#else
+  fd_set rset;
+  struct timeval tv;
+#endif
+
+  /* all clients' packets go through the one socket */
+  n = IMGDB_SOCKBUF;
+  setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &n, sizeof(int));
+  setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &n, sizeof(int));
+
+  while (1) {
+    wait = timers();
+
+#ifdef __linux__
+    n = epoll_wait(ep, &ev, 1, wait < 0 ? -1 : (int) ((wait+999)/1000));
+#else
+    FD_ZERO(&rset);
+    FD_SET(sd, &rset);
+    tv.tv_sec = wait/1000000L;
+    tv.tv_usec = wait%1000000L;
+    n = select(sd+1, &rset, NULL, NULL, wait < 0 ? NULL : &tv);
+#endif
+    if (n <= 0) {
+      continue;
+    }
+
+    ntouched = 0;
+    do {
+      fromlen = sizeof(struct sockaddr_in);
+      len = recvfrom(sd, pkt, sizeof(pkt), MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen);
+      if (len >= 0 && (f = handlepkt(&from, pkt, len)) && !f->acked) {
+        f->acked = true;
+        touched[ntouched++] = f;
+      }
+    } while (len >= 0);
+
+    for (i = 0; i < ntouched; i++) {
+      touched[i]->send(sd);
+      if (senderr(touched[i])) {
+        reap(touched[i]);
+      }
+    }
+  }
+
+#ifdef __linux__
+  close(ep);
+#endif
+  return;
+}
+
 int
 main(int argc, char *argv[])
 { 
@@ -549,14 +1255,12 @@ main(int argc, char *argv[])
   
   // parse args, see the comments for imgdb::args()
   if (imgdb.args(argc, argv)) {
-    fprintf(stderr, "Usage: %s [ -d <drop probability> ]\n",
+    fprintf(stderr, "Usage: %s [ -d <drop probability> -a <gbn|sr> -c <aimd|delay|none> -f <dup ACKs> ]\n",
             argv[0]); 
     exit(1);
   }
 
-  while (1) {
-    imgdb.handleqry();
-  }
+  imgdb.serve();
     
 #ifdef _WIN32
   WSACleanup();
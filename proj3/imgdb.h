@@ -20,9 +20,12 @@
 #ifndef __IMGDB_H__
 #define __IMGDB_H__
 
+#include <map>
+#include <utility>         // pair
 #include "ltga.h"
 #include "socks.h"
 #include "netimg.h"
+#include "cc.h"
 
 #ifdef _WIN32
 #define IMGDB_DIRSEP "\\"
@@ -31,39 +34,173 @@
 #endif
 #define IMGDB_FOLDER    "."
 
-class imgdb {
-  struct sockaddr_in self;
-  char sname[NETIMG_MAXFNAME];
+#define IMGDB_GBN       0    // Go-Back-N sender, the default
+#define IMGDB_SR        1    // Selective Repeat sender
 
-  struct sockaddr_in client;
+#define IMGDB_MINRTO     20000   // retransmission timeout bounds, usecs,
+#define IMGDB_MAXRTO  (NETIMG_SLEEP*1000000L+NETIMG_USLEEP)
+                                 // see Flow::rttupdate(), at most the
+                                 // client's own timeout, so that it
+                                 // hears a retransmission before giving
+                                 // up, see IMGDB_MAXIDLE
+#define IMGDB_RTTGRAN     1000   // clock granularity, usecs
+
+#define IMGDB_DUPTHRESH      3   // duplicate ACKs before fast retransmit
 
+#define IMGDB_MAXFLOW      512   // clients served at the same time
+#define IMGDB_SOCKBUF  4194304   // socket buffers shared by all clients
+#define IMGDB_MAXIDLE  (NETIMG_MAXTRIES*(NETIMG_SLEEP*1000000L+NETIMG_USLEEP))
+                                 // usecs without hearing from a client
+                                 // before giving up, as long as the
+                                 // client itself would wait
+
+/* states of a Flow, see Flow::recvack() and Flow::timeout() */
+#define IMGDB_IDLE      0    // not in use
+#define IMGDB_IMSG      1    // imsg sent, waiting for its ACK
+#define IMGDB_DATA      2    // sending the image
+#define IMGDB_FIN       3    // NETIMG_FIN sent, waiting for its ACK
+
+/* Server-wide settings every Flow is started with, see imgdb::args() */
+struct imgcfg {
   float pdrop;
+  char arq;               // IMGDB_GBN or IMGDB_SR
+  const char *ccname;     // congestion controller, see cc_new()
+  int dupthresh;          // duplicate ACKs that trigger fast retransmit
+};
+
+/* One client's transfer, from its query to the ACK of NETIMG_FIN.
+   Everything the sender used to keep on its stack while blocked
+   waiting for ACKs lives here instead, so that the server can move
+   many transfers along at once, each as its ACKs and timers come. */
+class Flow {
+  imgcfg cfg;
+
   unsigned short mss;  // receiver's maximum segment size, in bytes
   // used in Lab6 and PA3:
   unsigned char rwnd;  // receiver's window, in packets, each of size <= mss
   unsigned char fwnd;  // receiver's FEC window, in packets
 
   LTGA curimg;
+  unsigned char *ip;   // start of image, NULL if none was found
+  long img_size;
+  int datasize;        // image bytes per segment
+  int nsegs;
+
+  /* imsg or NETIMG_FIN, sent until ACKed, see Flow::sendpkt() */
+  imsg_t imsg;
+  ihdr_t fin;
+  int tries;
+  struct timeval sent;      // when the imsg or FIN was last sent
+  struct timeval heard;     // when the client was last heard from
+  struct timeval last;      // Go-Back-N: last window sent or ACK
+
+  int gso;   // whether to try UDP_SEGMENT, see socks_sendsegs()
+
+  /* packets queued to be sent to the client together, see
+     Flow::queuepkt() */
+  struct msghdr mh;
+  ihdr_t hdrs[SOCKS_GSOSEGS];
+  struct iovec tiov[SOCKS_GSOSEGS*NETIMG_NUMIOV];
+  int ntrain;     // packets queued
+  int trainmax;   // most packets queued
+  int dgsize;     // size of all queued packets but the last
+
+  /* retransmission timeout, estimated from the client's ACKs, see
+     Flow::rttupdate() */
+  long srtt;      // smoothed RTT, usecs, 0 before the first sample
+  long rttvar;    // RTT variation, usecs
+  long rto;       // retransmission timeout, usecs, with any backoff
+  struct timeval *segsent;  // per segment, when last sent
+  unsigned char *segtries;  // per segment, times sent
+  unsigned char *sacked;    // per segment, whether acknowledged
+  unsigned int ackhigh;     // highest cumulative ACK so far
+
+  cc *cong;                 // congestion controller, see cc.h
+  unsigned int sndhigh;     // highest offset sent so far
+  unsigned int rndmark;     // round trip ends once ACKed up to here
+  int dupacks;              // duplicate ACKs of ackhigh so far
+
+  /* FEC of the window being sent */
+  const unsigned char *parity;  // precomputed, NULL if none
+  const unsigned char *fecpre;  // of this window, if precomputed
+  unsigned char *fec;           // else accumulated here
+
+  /* Go-Back-N sender */
+  unsigned int snd_next;
+  unsigned int window_base;
+  int wnd;        // effective window, min(cwnd, rwnd)
+  int usable;
+  int fec_count;  // segments of this FEC window gone through
+  int fec_sent;   // how many of those actually went out this time
+
+  /* Selective Repeat sender */
+  int srwnd;
+  int base;       // first segment not acknowledged
+  int next;       // first segment never sent
+
+  char readimg(char *imgname, int verbose);
+  double marshall_imsg(imsg_t *imsg);
+  int sendpkt(int sd, void *pkt, int size);
+  void rttinit();
+  void rttupdate(long r);
+  void rttbackoff();
+  void queuepkt(int sd, unsigned char type, unsigned int seqn, const void *data, int size);
+  int sendtrain(int sd);
+  void sendseg(int sd, unsigned int off, int segsize, unsigned int una);
+  void sendfec(int sd, unsigned int seqn, const unsigned char *fec, int count, bool reused);
+  int markack(ihdr_t *ack, unsigned char *pkt, int len);
+  int fastrexmit(int sd);
+  void startdata(int sd);
+  void sendgbn(int sd);
+  void sendsr(int sd);
+  void sendfin(int sd);
 
 public:
-  int sd;  // image socket
+  int state;      // IMGDB_IDLE, IMGDB_IMSG, IMGDB_DATA, or IMGDB_FIN
+  bool acked;     // ACKed since last sent to, see imgdb::serve()
+  int err;        // errno of a failed send to the client, 0 if none
+  struct sockaddr_in client;
+
+  Flow() { state = IMGDB_IDLE; acked = false; err = 0; ip = NULL; cong = NULL; fec = NULL;
+           segsent = NULL; segtries = NULL; sacked = NULL; }
+  void init(int sd, struct sockaddr_in *from, iqry_t *iqry, imgcfg *c);
+  void recvack(int sd, unsigned char *pkt, int len);
+  void send(int sd);
+  long timeout(int sd, struct timeval *now);
+  void done();
+};
+
+class imgdb {
+  struct sockaddr_in self;
+  char sname[NETIMG_MAXFNAME];
+
+  imgcfg cfg;
+
+  Flow flows[IMGDB_MAXFLOW];
+  int nflows;     // flows in use
+  std::map<std::pair<unsigned int, unsigned short>, Flow *> clients;
+
+  char checkqry(iqry_t *iqry, int len);
+  Flow *handlepkt(struct sockaddr_in *from, unsigned char *pkt, int len);
+  void reap(Flow *f);
+  bool senderr(Flow *f);
+  long timers();
+
+public:
+  int sd;  // image socket, shared by all clients
 
   imgdb() { // default constructor
-    pdrop = NETIMG_PDROP;
+    cfg.pdrop = NETIMG_PDROP;
+    cfg.arq = IMGDB_GBN;
+    cfg.ccname = "aimd";
+    cfg.dupthresh = IMGDB_DUPTHRESH;
+    nflows = 0;
 
     sd = socks_servinit((char *) "imgdb", &self, sname); // Task 1
   }
 
   int args(int argc, char *argv[]);
-
-  char readimg(char *imgname, int verbose);
-
-  // image query-reply
-  void handleqry();
-  char recvqry(int sd, iqry_t *iqry);
-  double marshall_imsg(imsg_t *imsg);
-  int sendpkt(int sd, char *pkt, int size, ihdr_t *ack);
-  void sendimg(int sd, imsg_t *imsg, unsigned char *image, long img_size, int numseg);
+  void serve();
 };  
 
 #endif /* __IMGDB_H__ */
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2015 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University 
+ * may not be used to endorse or promote products derived from this 
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>         // fprintf(), perror()
+#include <stdlib.h>        // atoi(), calloc()
+#include <assert.h>        // assert()
+#include <string.h>        // memset(), memcpy(), strchr()
+#include <string>
+using namespace std;
+#ifdef _WIN32
+#include <winsock2.h>      // htons(), htonl()
+#include "wingetopt.h"
+#else
+#include <unistd.h>        // getopt()
+#include <arpa/inet.h>     // htons(), htonl()
+#endif
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+#include "ltga.h"
+#include "netimg.h"
+#include "fec.h"
+
+/*
+ * imgpak: converts TGA images into ready-to-serve containers, see
+ * LTGAPakHeader in ltga.h.  For each "<image>.tga" given on the
+ * command line, writes "<image>.tga.pak" holding the imsg_t fields,
+ * the pixels in RGB(A) order, and the FEC parity blocks for each
+ * -f <mss>:<fwnd> pair given (default NETIMG_MSS:NETIMG_FECWIN).
+ */
+
+typedef struct {
+  unsigned short mss;
+  unsigned char fwnd;
+} fecparm_t;
+
+static long
+imgpak_align(long offset)
+{
+  return((offset + LTGA_PAKALIGN-1) / LTGA_PAKALIGN * LTGA_PAKALIGN);
+}
+
+/*
+ * imgpak_args: parses command line args.  Fills in "fecs" with the
+ * -f pairs and sets "*nfec".  Returns the index of the first image
+ * name in argv, or 0 on failure.
+ */
+int
+imgpak_args(int argc, char *argv[], fecparm_t *fecs, int *nfec)
+{
+  char c, *p;
+  extern char *optarg;
+  extern int optind;
+  int mss, fwnd;
+
+  *nfec = 0;
+  while ((c = getopt(argc, argv, "f:")) != EOF) {
+    switch (c) {
+    case 'f':
+      p = strchr(optarg, ':');
+      if (!p || *nfec >= LTGA_PAKMAXFEC) {
+        return(0);
+      }
+      mss = atoi(optarg);
+      fwnd = atoi(p+1);
+      if (mss < NETIMG_MINSS || mss > NETIMG_MSS ||
+          fwnd < 1 || fwnd > NETIMG_MAXWIN) {
+        return(0);
+      }
+      fecs[*nfec].mss = (unsigned short) mss;
+      fecs[*nfec].fwnd = (unsigned char) fwnd;
+      (*nfec)++;
+      break;
+    default:
+      return(0);
+      break;
+    }
+  }
+
+  if (!*nfec) {
+    fecs[0].mss = NETIMG_MSS;
+    fecs[0].fwnd = NETIMG_FECWIN;
+    *nfec = 1;
+  }
+
+  return(optind < argc ? optind : 0);
+}
+
+/*
+ * imgpak_write: writes "img" and its parity blocks for the "nfec"
+ * (mss, fwnd) pairs in "fecs" to file "pakname".
+ * Returns 0 on success, 1 on failure.
+ */
+int
+imgpak_write(LTGA *img, fecparm_t *fecs, int nfec, const char *pakname)
+{
+  LTGAPakHeader *hdr;
+  unsigned char *pak, *pixels, *block;
+  long imgsize, paksize, offset;
+  int i, datasize, segsize, numseg, nblocks, g, s;
+  unsigned short format;
+  FILE *fp;
+
+  pixels = img->GetPixels();
+  imgsize = (long) img->GetImageWidth()*img->GetImageHeight()*(img->GetPixelDepth()/8);
+
+  /* lay out the sections first, to size the file */
+  offset = imgpak_align(LTGA_PAKALIGN + imgsize);
+  paksize = offset;
+  for (i = 0; i < nfec; i++) {
+    datasize = fecs[i].mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+    numseg = (imgsize + datasize-1) / datasize;
+    nblocks = (numseg + fecs[i].fwnd-1) / fecs[i].fwnd;
+    paksize = imgpak_align(paksize + (long) nblocks*datasize);
+  }
+  pak = (unsigned char *) calloc(paksize, 1);
+  net_assert(!pak, "imgpak_write: calloc");
+
+  hdr = (LTGAPakHeader *) pak;
+  memcpy(hdr->magic, LTGA_PAKMAGIC, sizeof(hdr->magic));
+
+  /* same as imgdb::marshall_imsg() */
+  if (img->GetImageType() == itGreyscale) {
+    format = img->GetAlphaDepth() ? GL_LUMINANCE_ALPHA : GL_LUMINANCE;
+  } else {
+    format = img->GetAlphaDepth() ? GL_RGBA : GL_RGB;
+  }
+  hdr->im_depth = (unsigned char) (img->GetPixelDepth()/8);
+  hdr->alpha = (unsigned char) img->GetAlphaDepth();
+  hdr->im_format = htons(format);
+  hdr->im_width = htons((unsigned short) img->GetImageWidth());
+  hdr->im_height = htons((unsigned short) img->GetImageHeight());
+  hdr->pixoffset = htonl(LTGA_PAKALIGN);
+  hdr->pixsize = htonl((unsigned int) imgsize);
+  memcpy(pak+LTGA_PAKALIGN, pixels, imgsize);
+
+  /* parity block g is the XOR of the fwnd segments starting at
+     g*fwnd*datasize, computed the way imgdb::sendimg() does */
+  hdr->nfec = htonl(nfec);
+  for (i = 0; i < nfec; i++) {
+    datasize = fecs[i].mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+    numseg = (imgsize + datasize-1) / datasize;
+    nblocks = (numseg + fecs[i].fwnd-1) / fecs[i].fwnd;
+
+    hdr->fec[i].mss = htons(fecs[i].mss);
+    hdr->fec[i].fwnd = fecs[i].fwnd;
+    hdr->fec[i].datasize = htonl(datasize);
+    hdr->fec[i].nblocks = htonl(nblocks);
+    hdr->fec[i].offset = htonl((unsigned int) offset);
+
+    for (g = 0; g < nblocks; g++) {
+      block = pak + offset + (long) g*datasize;
+      for (s = g*fecs[i].fwnd; s < (g+1)*fecs[i].fwnd && s < numseg; s++) {
+        segsize = imgsize - (long) s*datasize;
+        segsize = segsize > datasize ? datasize : segsize;
+        if (s == g*fecs[i].fwnd) {
+          fec_init(block, pixels + (long) s*datasize, datasize, segsize);
+        } else {
+          fec_accum(block, pixels + (long) s*datasize, datasize, segsize);
+        }
+      }
+    }
+    offset = imgpak_align(offset + (long) nblocks*datasize);
+  }
+
+  fp = fopen(pakname, "wb");
+  if (!fp) {
+    free(pak);
+    return(1);
+  }
+  i = fwrite(pak, paksize, 1, fp) != 1;
+  i |= fclose(fp) != 0;
+  free(pak);
+
+  return(i);
+}
+
+int
+main(int argc, char *argv[])
+{
+  fecparm_t fecs[LTGA_PAKMAXFEC];
+  int nfec, first, i, err = 0;
+  string pakname;
+  LTGA img;
+
+  first = imgpak_args(argc, argv, fecs, &nfec);
+  if (!first) {
+    fprintf(stderr, "Usage: %s [ -f <mss>:<fwnd> ]... <image>.tga...\n", argv[0]);
+    exit(1);
+  }
+
+  for (i = first; i < argc; i++) {
+    if (!img.LoadFromFile(argv[i])) {
+      fprintf(stderr, "%s: %s: not a supported TGA image.\n", argv[0], argv[i]);
+      err = 1;
+      continue;
+    }
+    pakname = argv[i];
+    pakname += LTGA_PAKEXT;
+    if (imgpak_write(&img, fecs, nfec, pakname.c_str())) {
+      perror(pakname.c_str());
+      err = 1;
+      continue;
+    }
+    fprintf(stderr, "%s: wrote %s\n", argv[0], pakname.c_str());
+  }
+
+  exit(err);
+}
@@ -18,7 +18,7 @@
  *
 */
 #include <stdio.h>         // fprintf(), perror(), fflush()
-#include <stdlib.h>        // atoi()
+#include <stdlib.h>        // atoi(), malloc()
 #include <assert.h>        // assert()
 #include <limits.h>        // LONG_MAX
 #include <math.h>          // ceil()
@@ -38,34 +38,96 @@
 #include <sys/types.h>     // u_short
 #include <sys/socket.h>    // socket API
 #include <sys/ioctl.h>     // ioctl(), FIONBIO
+#include <sys/time.h>      // gettimeofday()
+#include <sys/select.h>    // select()
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>     // epoll_create1(), epoll_wait()
+#endif
+#ifndef NETIMG_HEADLESS
+#include <pthread.h>       // pthread_create(), pthread_cond_wait()
 #ifdef __APPLE__
 #include <GLUT/glut.h>
 #else
 #include <GL/glut.h>
 #endif
+#endif
 using namespace std;
 
 #include "netimg.h"
 #include "socks.h"
 #include "fec.h"          // Lab6
 
-int sd;                   // socket descriptor
-imsg_t imsg;
+/* state of one image transfer; the image on display, if any, is that
+   of the first transfer whose image was found, see netimg_show() */
+typedef struct {
+  char *name;               // image queried
+  int sd;                   // socket descriptor, connected to server
+  char err;                 // 0 while waiting for imsg, then its type
+  bool over;                // transfer completed or given up
+  int tries;                // number of queries sent
+  struct timeval last;      // last query sent or packet received
+
+  imsg_t imsg;
+  long img_size;
+  unsigned char *image;
+
+  /* reassembly: data segments are kept whatever order they arrive
+     in; segment i is at offset i*datasize, FEC window k covers
+     segments k*fwnd to (k+1)*fwnd-1 */
+  unsigned char *segrcvd;  // per data segment, whether received
+  unsigned int highest;    // end of highest data segment received
+  bool gro;                // whether the socket coalesces datagrams
+  unsigned int cumack;     // offset of first segment not received
+  unsigned char *fecbuf;   // per FEC window, its FEC data
+  unsigned char *fecrcvd;  // per FEC window, whether fecbuf holds it
+  bool fin;  // whether NETIMG_FIN has been received
+  int unacked;             // segments received but not yet ACKed
+  struct timeval ackdue;   // when to ACK them at the latest
+
+  /* transfer statistics, reported by netimg_report() */
+  struct {
+    long bytes;       // data bytes received, including duplicates
+    int pkts;         // data segments received
+    int dups;         // data segments already received before
+    int retx;         // data segments below the highest offset seen
+    int holes;        // data segments skipped over on first arrival
+    int ooo;          // data segments not at the highest offset seen
+    int fecs;         // data segments patched with FEC
+    int acks;         // ACKs sent
+    int ackdrops;     // ACKs dropped, see pdrop
+    struct timeval start, first, done;
+  } stat;
+} xfer_t;
+
+xfer_t xfers[NETIMG_MAXIMGS];
+int nxfers;
+
+xfer_t *shown;            // transfer on display, NULL until one is found
+imsg_t imsg;              // of shown, for netimglut.cpp
 long img_size;
 unsigned char *image;
+#ifndef NETIMG_HEADLESS
+/* the receive thread hands the first image found over to the GLUT
+   thread, which sets up its display, see netimg_show() */
+pthread_mutex_t showlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t showcond = PTHREAD_COND_INITIALIZER;
+bool showready;           // image on display allocated by netimg_imginit()
+bool recvdone;            // receive thread is done with all transfers
+#endif
 unsigned short mss;       // receiver's maximum segment size, in bytes
 unsigned char rwnd;       // receiver's window, in packets, of size <= mss
 unsigned char fwnd;       // Lab6: receiver's FEC window < rwnd, in packets
-
-int fec_count; // how many data segments has been received in this fec window
-unsigned int fec_start; // starting byte position of current fec window
-unsigned int fec_next; // starting byte position of next expected data segment
-unsigned int fec_lost; // the first lost data segment in this fec window
+unsigned char *rcvbuf;    // staging buffer for rwnd packets of mss bytes
 
 // PA3: for ACKs
 float pdrop;
-bool mode; // whether the client is in go back N mode or not
+int ackevery;             // ACK every this many segments in order
+int ackdelay;             // or after this many ms, whichever first
+char *progname;
+char *outname;           // headless: file to write the image to
+char *jsonname;          // file to write statistics to, "-" for stdout
+volatile sig_atomic_t dumpstats;  // SIGUSR1 received
 
 /*
  * netimg_args: parses command line args.
@@ -73,28 +135,37 @@ bool mode; // whether the client is in go back N mode or not
  * Returns 0 on success or 1 on failure.  On successful return,
  * "*sname" points to the server's name, and "port" points to the port
  * to connect at server, in network byte order.  Both "*sname", and
- * "port" must be allocated by caller.  The variable "*imgname" points
- * to the name of the image to search for.  The global variables mss,
- * rwnd, and pdrop are initialized.
+ * "port" must be allocated by caller.  The images to search for,
+ * given with -q or following all the options, are stored in xfers[]
+ * and counted in nxfers.  The global variables mss, rwnd, pdrop,
+ * ackevery, ackdelay, and jsonname are initialized, and, in the
+ * headless build, outname.
  *
  * Nothing else is modified.
  */
 int
-netimg_args(int argc, char *argv[], char **sname, u_short *port, char **imgname)
+netimg_args(int argc, char *argv[], char **sname, u_short *port)
 {
   char c, *p;
   extern char *optarg;
+  extern int optind;
   int arg;
 
   if (argc < 5) {
     return (1);
   }
-  
+
   pdrop = NETIMG_PDROP;
   rwnd = NETIMG_RCVWIN;
   mss = NETIMG_MSS;
+  ackevery = NETIMG_ACKEVERY;
+  ackdelay = NETIMG_ACKDELAY;
 
-  while ((c = getopt(argc, argv, "s:q:w:m:d:")) != EOF) {
+#ifdef NETIMG_HEADLESS
+  while ((c = getopt(argc, argv, "s:q:w:m:d:a:A:j:o:")) != EOF) {
+#else
+  while ((c = getopt(argc, argv, "s:q:w:m:d:a:A:j:")) != EOF) {
+#endif
     switch (c) {
     case 's':
       for (p = optarg+strlen(optarg)-1;  // point to last character of
@@ -114,14 +185,17 @@ netimg_args(int argc, char *argv[], char **sname, u_short *port, char **imgname)
     case 'q':
       net_assert((strlen(optarg) >= NETIMG_MAXFNAME),
                  "netimg_args: image name too long");
-      *imgname = optarg;
+      if (nxfers >= NETIMG_MAXIMGS) {
+        return(1);
+      }
+      xfers[nxfers++].name = optarg;
       break;
     case 'w':
       arg = atoi(optarg);
       if (arg < NETIMG_MINWIN || arg > NETIMG_MAXWIN) {
         return(1);
       }
-      rwnd = (unsigned char) arg; 
+      rwnd = (unsigned char) arg;
       break;
     case 'm':
       arg = atoi(optarg);
@@ -137,17 +211,47 @@ netimg_args(int argc, char *argv[], char **sname, u_short *port, char **imgname)
                 argv[0], NETIMG_MINPROB, NETIMG_MAXPROB);
       }
       break;
+    case 'a':
+      ackevery = atoi(optarg);  // global
+      if (ackevery < 1) {
+        return(1);
+      }
+      break;
+    case 'A':
+      ackdelay = atoi(optarg);  // global
+      if (ackdelay < 0) {
+        return(1);
+      }
+      break;
+    case 'j':
+      jsonname = optarg;  // global
+      break;
+#ifdef NETIMG_HEADLESS
+    case 'o':
+      outname = optarg;  // global
+      break;
+#endif
     default:
       return(1);
       break;
     }
   }
 
-  return (0);
+  /* more images to fetch concurrently */
+  for (; optind < argc; optind++) {
+    net_assert((strlen(argv[optind]) >= NETIMG_MAXFNAME),
+               "netimg_args: image name too long");
+    if (nxfers >= NETIMG_MAXIMGS) {
+      return(1);
+    }
+    xfers[nxfers++].name = argv[optind];
+  }
+
+  return (nxfers ? 0 : 1);
 }
 
 /*
- * netimg_sendqry: send a query for provided imgname to
+ * netimg_sendqry: send a query for the image of transfer "x" to
  * connected server.  Query is of type iqry_t, defined in netimg.h.
  * The query packet must be of version NETIMG_VERS and of type
  * NETIMG_SYNQRY both also defined in netimg.h. In addition to the
@@ -159,7 +263,7 @@ netimg_args(int argc, char *argv[], char **sname, u_short *port, char **imgname)
  * On send error, return 0, else return 1
  */
 int
-netimg_sendqry(char *imgname)
+netimg_sendqry(xfer_t *x)
 {
   int bytes;
   iqry_t iqry;
@@ -169,331 +273,950 @@ netimg_sendqry(char *imgname)
   iqry.iq_mss = htons(mss);      // global
   iqry.iq_rwnd = rwnd;           // global
   iqry.iq_fwnd = fwnd = NETIMG_FECWIN >= rwnd ? rwnd-1 : NETIMG_FECWIN;  // Lab6
-  strcpy(iqry.iq_name, imgname); 
-  bytes = send(sd, (char *) &iqry, sizeof(iqry_t), 0);
+  strcpy(iqry.iq_name, x->name);
+  bytes = send(x->sd, (char *) &iqry, sizeof(iqry_t), 0);
+  if (!x->tries++) {
+    gettimeofday(&x->stat.start, NULL);
+  }
+  gettimeofday(&x->last, NULL);
   if (bytes != sizeof(iqry_t)) {
     return(0);
   }
 
   return(1);
 }
-  
+
 /*
  * netimg_recvimsg: receive an imsg_t packet from server and store it
- * in the global variable imsg.  The type imsg_t is defined in
- * netimg.h. Return NETIMG_EVERS if packet is of the wrong version.
- * Return NETIMG_ESIZE if packet received is of the wrong size.
- * Otherwise return the content of the im_type field of the received
- * packet. Upon return, all the integer fields of imsg MUST be in HOST
- * BYTE ORDER. If msg_type is NETIMG_FOUND, compute the size of the
- * incoming image and store the size in the global variable
- * "img_size".
+ * in x->imsg.  The type imsg_t is defined in netimg.h. Return
+ * NETIMG_EVERS if packet is of the wrong version.  Return
+ * NETIMG_ESIZE if packet received is of the wrong size.  Otherwise
+ * return the content of the im_type field of the received
+ * packet. Upon return, all the integer fields of x->imsg MUST be in
+ * HOST BYTE ORDER. If msg_type is NETIMG_FOUND, compute the size of
+ * the incoming image and store it in x->img_size.
  */
 char
-netimg_recvimsg()
+netimg_recvimsg(xfer_t *x)
 {
   int bytes;
   double imgdsize;
 
   /* receive imsg packet and check its version and type */
-  bytes = recv(sd, (char *) &imsg, sizeof(imsg_t), 0); // imsg global
+  bytes = recv(x->sd, (char *) &x->imsg, sizeof(imsg_t), 0);
   if (bytes != sizeof(imsg_t)) {
     return(NETIMG_ESIZE);
   }
-  if (imsg.im_vers != NETIMG_VERS) {
+  if (x->imsg.im_vers != NETIMG_VERS) {
     return(NETIMG_EVERS);
   }
 
-  if (imsg.im_type == NETIMG_FOUND) 
+  if (x->imsg.im_type == NETIMG_FOUND)
   {
-    imsg.im_height = ntohs(imsg.im_height);
-    imsg.im_width = ntohs(imsg.im_width);
-    imsg.im_format = ntohs(imsg.im_format);
+    x->imsg.im_height = ntohs(x->imsg.im_height);
+    x->imsg.im_width = ntohs(x->imsg.im_width);
+    x->imsg.im_format = ntohs(x->imsg.im_format);
 
-    imgdsize = (double) (imsg.im_height*imsg.im_width*(u_short)imsg.im_depth);
+    imgdsize = (double) (x->imsg.im_height*x->imsg.im_width*(u_short)x->imsg.im_depth);
     net_assert((imgdsize > (double) LONG_MAX), "netimg_recvimsg: image too big");
-    img_size = (long) imgdsize;                 // global
+    x->img_size = (long) imgdsize;
 
     ihdr_t ack;
     ack.ih_vers = NETIMG_VERS;
     ack.ih_type = NETIMG_ACK;
-    ack.ih_seqn = htonl(NETIMG_SYNSEQ); 
-    bytes=send(sd, &ack, sizeof(ihdr_t), 0);
+    ack.ih_seqn = htonl(NETIMG_SYNSEQ);
+    bytes=send(x->sd, &ack, sizeof(ihdr_t), 0);
     net_assert(bytes<0, "netimg_recvims: send ACK error");
   }
 
-  return((char) imsg.im_type);
+  return((char) x->imsg.im_type);
 }
 
-/* Callback function for GLUT.
- *
- * netimg_recvimg: called by GLUT when idle. On each call, receive a
- * chunk of the image from the network and store it in global variable
- * "image" at offset from the start of the buffer as specified in the
- * header of the packet.
- *
- * Terminate process on receive error.
+/*
+ * netimg_imsgerr: print why the query of transfer "x" failed.
  */
 void
-netimg_recvimg(void)
+netimg_imsgerr(char *progname, xfer_t *x)
 {
-  ihdr_t ihdr;  // memory to hold packet header
-  int err = recv(sd, &ihdr, sizeof(ihdr_t), MSG_PEEK);
-  if (err == -1 || ihdr.ih_vers != NETIMG_VERS)
-    return;  
+  if (x->err == NETIMG_NFOUND) {
+    fprintf(stderr, "%s: %s image not found.\n", progname, x->name);
+  } else if (x->err == NETIMG_EVERS) {
+    fprintf(stderr, "%s: %s wrong version number.\n", progname, x->name);
+  } else if (x->err == NETIMG_EBUSY) {
+    fprintf(stderr, "%s: %s image server busy.\n", progname, x->name);
+  } else if (x->err == NETIMG_ESIZE) {
+    fprintf(stderr, "%s: %s wrong size.\n", progname, x->name);
+  } else if (!x->err) {
+    fprintf(stderr, "%s: %s no reply from server.\n", progname, x->name);
+  } else {
+    fprintf(stderr, "%s: %s image receive error %d.\n", progname, x->name, x->err);
+  }
 
-  int segsize = ntohs(ihdr.ih_size);
-  unsigned int snd_next = ntohl(ihdr.ih_seqn);
+  return;
+}
 
-  int datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP; // maximum bytes of a data or FEC packet
-  int fec_num=(snd_next-fec_start)/(fwnd*datasize); // the number of FEC windows passed
-
-  struct iovec iov[NETIMG_NUMIOV];
-  iov[0].iov_base = &ihdr;
-  iov[0].iov_len = sizeof(ihdr_t);
-  struct msghdr mh;
-  mh.msg_name = NULL;
-  mh.msg_namelen = 0;
-  mh.msg_iov = iov;
-  mh.msg_iovlen = NETIMG_NUMIOV;
-  mh.msg_control = NULL;
-  mh.msg_controllen = 0;
+/*
+ * netimg_recvbatch: receive as many of the packets waiting at the
+ * socket of transfer "x" as fit into the staging buffer "rcvbuf", and
+ * store where each starts in "pkts" and its size in "lens".  On Linux
+ * all of them are received with a single recvmmsg() call, one packet
+ * per mss-sized slot, or, if the socket coalesces datagrams (x->gro),
+ * into NETIMG_GROBUFS slots of NETIMG_GROSIZE bytes, each holding as
+ * many packets as arrived back to back, see socks_grosize().
+ * Elsewhere with one recv() each.  Returns the number of packets
+ * received, 0 if none, and sets "*more" if all slots were filled, so
+ * that more packets may be waiting.
+ */
+int
+netimg_recvbatch(xfer_t *x, unsigned char **pkts, int *lens, bool *more)
+{
+  int i, n;
+#ifdef __linux__
+  struct mmsghdr msgs[NETIMG_MAXWIN];
+  struct iovec iovs[NETIMG_MAXWIN];
+  char ctls[NETIMG_GROBUFS][SOCKS_GROCTL];
+  int m, slots, slotsize, gsosize, off;
+
+  slots = x->gro ? NETIMG_GROBUFS : rwnd;
+  slotsize = x->gro ? NETIMG_GROSIZE : mss;
+  memset(msgs, 0, slots*sizeof(struct mmsghdr));
+  for (i = 0; i < slots; i++) {
+    iovs[i].iov_base = rcvbuf+i*slotsize;
+    iovs[i].iov_len = slotsize;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if (x->gro) {
+      msgs[i].msg_hdr.msg_control = ctls[i];
+      msgs[i].msg_hdr.msg_controllen = SOCKS_GROCTL;
+    }
+  }
+  m = recvmmsg(x->sd, msgs, slots, MSG_DONTWAIT, NULL);
+  *more = (m == slots);
+
+  /* split coalesced datagrams back into packets */
+  for (i = n = 0; i < m; i++) {
+    gsosize = x->gro ? socks_grosize(&msgs[i].msg_hdr) : 0;
+    if (gsosize <= 0) {
+      gsosize = msgs[i].msg_len;
+    }
+    for (off = 0; off < (int) msgs[i].msg_len && n < NETIMG_MAXWIN; off += gsosize) {
+      pkts[n] = rcvbuf+i*slotsize+off;
+      lens[n++] = min(gsosize, (int) msgs[i].msg_len-off);
+    }
+  }
+#else
+  for (n = 0; n < rwnd; n++) {
+    pkts[n] = rcvbuf+n*mss;
+    lens[n] = recv(x->sd, (char *) pkts[n], mss, 0);
+    if (lens[n] < 0) {
+      break;
+    }
+  }
+  *more = (n == rwnd);
+#endif
+
+  return(n < 0 ? 0 : n);
+}
+
+/*
+ * netimg_fecpatch: if FEC window "k" of transfer "x" is missing
+ * exactly one segment and its FEC data has been received, rebuild the
+ * missing segment from the FEC data and the other segments of the
+ * window.  Returns whether a segment was rebuilt.
+ */
+bool
+netimg_fecpatch(xfer_t *x, unsigned int k)
+{
+  int datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  unsigned int nsegs = (x->img_size+datasize-1)/datasize;
+  unsigned int i, first, last, hole = 0, holes = 0;
+  unsigned char *fec;
+  long off;
+  int segsize;
+
+  if (!x->fecrcvd[k]) {
+    return(false);
+  }
+  first = k*fwnd;
+  last = min(first+fwnd, nsegs);
+  for (i = first; i < last; i++) {
+    if (!x->segrcvd[i]) {
+      hole = i;
+      holes++;
+    }
+  }
+  if (holes != 1) {
+    return(false);
+  }
+
+  fec = x->fecbuf+k*datasize;
+  for (i = first; i < last; i++) {
+    if (i != hole) {
+      off = (long) i*datasize;
+      fec_accum(fec, x->image+off, datasize,
+                (int) min((long) datasize, x->img_size-off));
+    }
+  }
+  off = (long) hole*datasize;
+  segsize = (int) min((long) datasize, x->img_size-off);
+  memcpy(x->image+off, fec, segsize);
+  if (x == shown) {
+    netimg_imgdirty(off, segsize);
+  }
+  x->segrcvd[hole] = 1;
+  x->fecrcvd[k] = 0;
+  x->stat.fecs++;
+  fprintf(stderr, "netimg_recvimg: FEC patched offset: 0x%lx\n", off);
+
+  return(true);
+}
+
+/*
+ * netimg_sackfill: fill "sack", NETIMG_SACKLEN bytes, with a bitmap of
+ * the segments received past the cumulative ACK "ackseqn" of transfer
+ * "x": bit i, counting from the least significant bit of sack[0], is
+ * set if the segment at ackseqn+(i+1)*datasize has been received.
+ * Returns the number of bytes of "sack" in use, 0 if no bit is set.
+ */
+int
+netimg_sackfill(xfer_t *x, unsigned int ackseqn, unsigned char *sack,
+                int datasize)
+{
+  unsigned int seg = ackseqn/datasize+1;
+  int i, len = 0;
+
+  memset(sack, 0, NETIMG_SACKLEN);
+  for (i = 0; i < NETIMG_SACKLEN*8 && (seg+i)*datasize < x->highest; i++) {
+    if (x->segrcvd[seg+i]) {
+      sack[i/8] |= 1 << (i%8);
+      len = i/8+1;
+    }
+  }
+
+  return(len);
+}
 
+/*
+ * netimg_sendack: acknowledge what transfer "x" has received, the
+ * offset of the first segment not received followed by a SACK bitmap,
+ * see netimg_sackfill(), or, if "fin", NETIMG_FINSEQ.  With
+ * probability pdrop, the ACK is dropped instead.
+ */
+void
+netimg_sendack(xfer_t *x, bool fin)
+{
   ihdr_t ack;
+  unsigned char ackpkt[sizeof(ihdr_t)+NETIMG_SACKLEN];
+  int datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  int sacklen = 0, err;
+
   ack.ih_vers = NETIMG_VERS;
   ack.ih_type = NETIMG_ACK;
+  if (fin) {
+    ack.ih_seqn = htonl(NETIMG_FINSEQ);
+  } else {
+    ack.ih_seqn = htonl(x->cumack);
+    sacklen = netimg_sackfill(x, x->cumack, ackpkt+sizeof(ihdr_t), datasize);
+  }
+  x->unacked = 0;
+
+  if (((float) random())/INT_MAX < pdrop) {
+    fprintf(stderr, "netimg_recvimg: ack dropped 0x%x\n", ntohl(ack.ih_seqn));
+    x->stat.ackdrops++;
+  }
+  else
+  {
+    ack.ih_size = htons(sacklen);
+    memcpy(ackpkt, &ack, sizeof(ihdr_t));
+    err = send(x->sd, ackpkt, sizeof(ihdr_t)+sacklen, 0);
+    net_assert(err<0, "send ACK error");
+    x->stat.acks++;
+    fprintf(stderr, "netimg_recvimg: ack sent 0x%x\n", ntohl(ack.ih_seqn));
+  }
+
+  return;
+}
+
+/*
+ * netimg_recvpkt: handle one packet of "bytes" bytes received at
+ * "pkt" for transfer "x".  Image data is stored in x->image at the
+ * offset specified in the header of the packet, whatever order it
+ * arrives in.  FEC data is kept per FEC window until the window is
+ * missing exactly one segment, which is then rebuilt, see
+ * netimg_fecpatch().  Data is acknowledged with netimg_sendack():
+ * right away if it leaves or fills a gap, if a segment was rebuilt,
+ * or if it is a duplicate; otherwise only every ackevery segments, or
+ * after ackdelay ms, see netimg_recvloop().  Changes to the image on
+ * display are passed on with netimg_imgdirty().
+ */
+void
+netimg_recvpkt(xfer_t *x, unsigned char *pkt, int bytes)
+{
+  ihdr_t ihdr;  // memory to hold packet header
+  bool now = false;  // whether to ACK right away
+
+  if (bytes < (int) sizeof(ihdr_t)) {
+    return;
+  }
+  memcpy(&ihdr, pkt, sizeof(ihdr_t));
+  if (ihdr.ih_vers != NETIMG_VERS)
+    return;
+
+  int segsize = ntohs(ihdr.ih_size);
+  unsigned int snd_next = ntohl(ihdr.ih_seqn);
+  unsigned char *data = pkt+sizeof(ihdr_t);
+  bytes -= sizeof(ihdr_t);
+
+  int datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP; // maximum bytes of a data or FEC packet
+  unsigned int fecsize = fwnd*datasize;               // bytes of data per FEC window
 
   if (ihdr.ih_type == NETIMG_DATA)
   {
-    iov[1].iov_base = image+snd_next;;
-    iov[1].iov_len = segsize;
+    if (segsize > bytes || snd_next+segsize > (unsigned int) x->img_size ||
+        snd_next%datasize)
+      return;
 
-    fprintf(stderr, "netimg_recvimg: received offset 0x%x, %d bytes, waiting for 0x%x\n",
-                                       snd_next, segsize, fec_next);     
-    if (recvmsg(sd, &mh, 0) == -1)
-    {
-      close(sd);
-      fprintf(stderr, "recv img error");
-      exit(1);
+    if (!x->stat.pkts++) {
+      gettimeofday(&x->stat.first, NULL);
+    }
+    x->stat.bytes += segsize;
+    if (snd_next != x->highest) {
+      x->stat.ooo++;
+      now = true;
+    }
+    if (snd_next < x->highest) {
+      x->stat.retx++;
+    } else {
+      x->stat.holes += (snd_next-x->highest)/datasize;
+      x->highest = snd_next+segsize;
+    }
+    fprintf(stderr, "netimg_recvimg: received offset 0x%x, %d bytes, first missing 0x%x\n",
+            snd_next, segsize, x->cumack);
+
+    if (x->segrcvd[snd_next/datasize]) {
+      x->stat.dups++;
+      now = true;
+    } else {
+      memcpy(x->image+snd_next, data, segsize);
+      if (x == shown) {
+        netimg_imgdirty(snd_next, segsize);
+      }
+      x->segrcvd[snd_next/datasize] = 1;
+      now |= netimg_fecpatch(x, snd_next/fecsize);
     }
-    if(mode)
+  }
+  else if (ihdr.ih_type == NETIMG_FEC)
+  {
+    // ih_seqn is the end of the FEC window
+    if (snd_next == 0 || snd_next > (unsigned int) x->img_size)
+      return;
+    unsigned int k = (snd_next-1)/fecsize;
+    fprintf(stderr, "netimg_recvimg: received FEC offset: 0x%x, window %u\n", snd_next, k);
+    if (!x->fecrcvd[k])
     {
-      if(fec_next==snd_next) // take the client out of go back N mode
-      {
-        fprintf(stderr, "netimg_recvims: out of gbn.\n");
-        mode=false;
-
-        fec_count++;
-        fec_next=snd_next+segsize;
-        fec_lost=fec_next;
+      unsigned char *fec = x->fecbuf+k*datasize;
+      memcpy(fec, data, min(bytes, datasize));
+      if (bytes < datasize)
+        memset(fec+bytes, 0, datasize-bytes);
+      x->fecrcvd[k] = 1;
+    }
+    if (!netimg_fecpatch(x, k))
+      return;  // nothing new to acknowledge
+    now = true;
+  }
+  else if (ihdr.ih_type == NETIMG_FIN)
+  {
+    if (!x->fin) {
+      gettimeofday(&x->stat.done, NULL);
+    }
+    x->fin=true;
+    netimg_sendack(x, true);
+    return;
+  }
+  else  // e.g., a repeated imsg_t
+    return;
+
+  while (x->cumack < (unsigned int) x->img_size && x->segrcvd[x->cumack/datasize])
+    x->cumack += min(datasize, (int) (x->img_size-x->cumack));
+  if (x->cumack < x->highest) {
+    now = true;  // holes remain, the sender needs the SACKs
+  }
+
+  if (now || ++x->unacked >= ackevery) {
+    netimg_sendack(x, false);
+  } else if (x->unacked == 1) {
+    gettimeofday(&x->ackdue, NULL);
+    x->ackdue.tv_usec += ackdelay*1000L;
+    x->ackdue.tv_sec += x->ackdue.tv_usec/1000000L;
+    x->ackdue.tv_usec %= 1000000L;
+  }
+
+  return;
+}
+
+/*
+ * netimg_recvimg: drain the socket of transfer "x" of all the packets
+ * that have arrived, a batch of at most rwnd packets at a time, and
+ * handle them in order of arrival.
+ */
+void
+netimg_recvimg(xfer_t *x)
+{
+  unsigned char *pkts[NETIMG_MAXWIN];
+  int lens[NETIMG_MAXWIN];
+  int i, n;
+  bool more = true;
+
+  while (more && (n = netimg_recvbatch(x, pkts, lens, &more)) > 0) {
+    for (i = 0; i < n; i++) {
+      netimg_recvpkt(x, pkts[i], lens[i]);
+    }
+  }
+
+  return;
+}
+
+/*
+ * netimg_xferinit: get transfer "x", whose image has been found,
+ * ready to receive the image.  The image on display has already been
+ * allocated by netimg_imginit(), the others are allocated here.
+ * Datagrams arriving at its socket are coalesced where possible.
+ */
+void
+netimg_xferinit(xfer_t *x)
+{
+  int datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  long nwins;
+
+  if (!x->image) {
+    x->image = (unsigned char *) calloc(x->img_size, sizeof(unsigned char));
+    net_assert((x->image == NULL), "netimg_xferinit: calloc");
+  }
+  x->segrcvd = (unsigned char *) calloc(x->img_size/datasize+1, 1);
+  net_assert((x->segrcvd == NULL), "netimg_xferinit: calloc");
+  nwins = x->img_size/(fwnd*datasize)+1;
+  x->fecbuf = (unsigned char *) malloc(nwins*datasize);
+  x->fecrcvd = (unsigned char *) calloc(nwins, 1);
+  net_assert((x->fecbuf == NULL || x->fecrcvd == NULL),
+             "netimg_xferinit: alloc");
+  x->gro = socks_gro(x->sd);
+
+  return;
+}
+
+/*
+ * netimg_xferend: done with transfer "x", whether complete or not.
+ */
+void
+netimg_xferend(xfer_t *x)
+{
+  x->over = true;
+  socks_close(x->sd);
+
+  return;
+}
+
+/*
+ * netimg_xferwait: how long, in usecs, transfer "x" may go without
+ * receiving a packet.  While waiting for a reply to its query, that's
+ * the sender's retransmission timeout, after which the query is sent
+ * again.  After NETIMG_FIN, it's the same, long enough to answer
+ * retransmitted FINs.  In between, the transfer is given up if nothing
+ * arrives for NETIMG_MAXTRIES times that long.
+ */
+long
+netimg_xferwait(xfer_t *x)
+{
+  long usecs = NETIMG_SLEEP*1000000L + NETIMG_USLEEP;
+
+  if (!x->err || x->fin) {
+    return(usecs);
+  }
+  return(usecs*NETIMG_MAXTRIES);
+}
+
+/*
+ * netimg_usecs: usecs from "from" to "to".
+ */
+long
+netimg_usecs(struct timeval *from, struct timeval *to)
+{
+  return((to->tv_sec-from->tv_sec)*1000000L + (to->tv_usec-from->tv_usec));
+}
+
+/*
+ * netimg_show: the image of transfer "x" is the first one found, put
+ * it on display.  In the GLUT build, the GLUT thread allocates the
+ * image and sets up the display, see main(); wait until it has.
+ */
+void
+netimg_show(xfer_t *x)
+{
+  imsg = x->imsg;
+  img_size = x->img_size;
+#ifdef NETIMG_HEADLESS
+  shown = x;
+  netimg_imginit(imsg.im_format);
+#else
+  pthread_mutex_lock(&showlock);
+  shown = x;
+  pthread_cond_broadcast(&showcond);
+  while (!showready) {
+    pthread_cond_wait(&showcond, &showlock);
+  }
+  pthread_mutex_unlock(&showlock);
+#endif
+  x->image = (unsigned char *) image;
+
+  return;
+}
+
+/*
+ * netimg_recvxfer: socket of transfer "x" is readable.  Receive the
+ * reply to its query, or the packets of its image.  The first image
+ * found goes on display, see netimg_show().
+ */
+void
+netimg_recvxfer(xfer_t *x)
+{
+  if (x->over) {
+    return;
+  }
+  gettimeofday(&x->last, NULL);
+
+  if (!x->err) {
+    x->err = netimg_recvimsg(x);
+    if (x->err == NETIMG_FOUND) {
+      if (!shown) {
+        netimg_show(x);
       }
+      netimg_xferinit(x);
+    } else {
+      netimg_imsgerr(progname, x);
+      netimg_xferend(x);
     }
+    return;
+  }
 
-    else
-    {
-      /* --------------- at least one FEC window lost --------------- */
-      if(fec_num>0) 
-      {
-        //(1): if we have received FEC window full of consecutive data 
-        if(fec_count==fwnd)
-        {
-          fec_start+=fwnd*datasize; 
-          fec_lost=fec_start;
-
-          if(snd_next==fec_next) // no data segment missing within next FEC window
-          { 
-            fec_next=snd_next+segsize;
-            fec_lost=fec_next;
-            fec_count=1;
-          }
-          else if(snd_next==fec_next+segsize) // missing the first data segment in the next FEC window       
-          {
-            fec_next=snd_next+segsize;
-            fec_count=1;
-          }
-          else // missing more than one consecutive data segement in the next FEC window, trigger go back N mode
-          {
-            fprintf(stderr, "in gbn: consecutive losses or fec loss.\n");
-            mode=true;
+  netimg_recvimg(x);
 
-            fec_count=0;
-            fec_next=fec_lost;
-          }
-        }
-        //(2): the previous FEC window lost at least one data segment, unable to recover, trigger go back N mode
-        else
-        {
-          fprintf(stderr, "in gbn: consecutive losses or fec loss.\n");
-          mode=true;
-
-          fec_start=fec_lost;
-          fec_next=fec_lost;
-          fec_count=0;
-        }
+  return;
+}
+
+/*
+ * netimg_jsonstr: print string "str" to "fp" as a JSON string.
+ */
+void
+netimg_jsonstr(FILE *fp, char *str)
+{
+  fputc('"', fp);
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      fprintf(fp, "\\%c", *str);
+    } else if ((unsigned char) *str < 0x20) {
+      fprintf(fp, "\\u%04x", *str);
+    } else {
+      fputc(*str, fp);
+    }
+  }
+  fputc('"', fp);
+
+  return;
+}
+
+/*
+ * netimg_json: write the statistics of all transfers so far as a JSON
+ * object to file jsonname, or to stdout if jsonname is "-".  Nothing
+ * is written if jsonname is not set.  Times are in seconds since the
+ * transfer's first query; "complete" is null until NETIMG_FIN has
+ * been received.  The file is overwritten on each call.
+ */
+void
+netimg_json()
+{
+  struct timeval now;
+  FILE *fp;
+  xfer_t *x;
+  int i;
+  const char *state;
+
+  if (!jsonname) {
+    return;
+  }
+  if (strcmp(jsonname, "-")) {
+    fp = fopen(jsonname, "w");
+    if (!fp) {
+      perror(jsonname);
+      return;
+    }
+  } else {
+    fp = stdout;
+  }
+
+  gettimeofday(&now, NULL);
+  fprintf(fp, "{\n  \"mss\": %d,\n  \"rwnd\": %d,\n  \"fwnd\": %d,\n"
+          "  \"pdrop\": %g,\n  \"images\": [", mss, rwnd, fwnd, pdrop);
+  for (i = 0; i < nxfers; i++) {
+    x = &xfers[i];
+    if (x->fin) {
+      state = "complete";
+    } else if (x->err && x->err != NETIMG_FOUND) {
+      state = "error";
+    } else if (x->over) {
+      state = "incomplete";
+    } else if (!x->err) {
+      state = "querying";
+    } else {
+      state = "receiving";
+    }
+
+    fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+    netimg_jsonstr(fp, x->name);
+    fprintf(fp, ", \"state\": \"%s\", \"size\": %ld,\n"
+            "     \"bytes\": %ld, \"segments\": %d, \"duplicates\": %d,"
+            " \"out_of_order\": %d, \"holes\": %d, \"retransmissions\": %d,\n"
+            "     \"fec_patched\": %d,"
+            " \"acks_sent\": %d, \"acks_dropped\": %d,\n",
+            state, x->img_size, x->stat.bytes, x->stat.pkts, x->stat.dups,
+            x->stat.ooo, x->stat.holes, x->stat.retx, x->stat.fecs,
+            x->stat.acks, x->stat.ackdrops);
+    if (x->stat.pkts) {
+      fprintf(fp, "     \"first_byte\": %.6f, ",
+              netimg_usecs(&x->stat.start, &x->stat.first)/1000000.0);
+    } else {
+      fprintf(fp, "     \"first_byte\": null, ");
+    }
+    if (x->fin) {
+      fprintf(fp, "\"complete\": %.6f}",
+              netimg_usecs(&x->stat.start, &x->stat.done)/1000000.0);
+    } else {
+      fprintf(fp, "\"complete\": null}");
+    }
+  }
+  fprintf(fp, "\n  ]\n}\n");
+
+  if (fp == stdout) {
+    fflush(fp);
+  } else {
+    fclose(fp);
+  }
+
+  return;
+}
+
+#ifdef SIGUSR1
+/*
+ * netimg_sigusr1: signal handler, has the receive loop write out the
+ * statistics.
+ */
+void
+netimg_sigusr1(int sig)
+{
+  dumpstats = 1;
+}
+#endif
+
+/*
+ * netimg_recvloop: wait for packets to arrive for any of the
+ * transfers and handle them with netimg_recvxfer(), so that ACKs go
+ * out as soon as data arrives, independent of how busy rendering is.
+ * The rows changed in the image on display are passed on to the GLUT
+ * thread through netimg_imgdirty().  All queries are first sent from
+ * here, at once, and those not answered are sent again, up to
+ * NETIMG_QRYTRIES times, as the server may be busy with other
+ * clients.  Delayed ACKs are sent when due.  Transfers time out as
+ * per netimg_xferwait().  On Linux the sockets are watched with
+ * epoll, elsewhere with select().  Statistics are written out when
+ * SIGUSR1 is received, see netimg_json().  Returns once all transfers
+ * are over.
+ */
+void
+netimg_recvloop()
+{
+  struct timeval now;
+  long usecs, wait;
+  int i, n;
+  xfer_t *x;
+#ifdef __linux__
+  struct epoll_event ev, evs[NETIMG_MAXIMGS];
+  int ep;
+
+  ep = epoll_create1(0);
+  net_assert((ep < 0), "netimg_recvloop: epoll_create1");
+  for (i = 0; i < nxfers; i++) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = &xfers[i];
+    n = epoll_ctl(ep, EPOLL_CTL_ADD, xfers[i].sd, &ev);
+    net_assert((n < 0), "netimg_recvloop: epoll_ctl");
+  }
+#else
+  fd_set rset;
+  struct timeval tv;
+  int maxsd;
+#endif
+
+  while (1) {
+    /* resend unanswered queries and time out silent transfers, then
+       wait for the earliest of the remaining timeouts */
+    gettimeofday(&now, NULL);
+    wait = -1;
+    for (i = 0; i < nxfers; i++) {
+      x = &xfers[i];
+      if (x->over) {
+        continue;
       }
-      /* --------------- no indication of FEC window lost, within same FEC window --------------- */
-      else
-      {
-        if(snd_next==fec_next) // if it is the expected data segment
-        {
-          fec_next=snd_next+segsize;
-          fec_count++;
-          if(snd_next==fec_lost)
-            fec_lost=fec_next;
+      if (x->unacked) {  // delayed ACK
+        usecs = netimg_usecs(&now, &x->ackdue);
+        if (usecs <= 0) {
+          netimg_sendack(x, false);
+        } else if (wait < 0 || usecs < wait) {
+          wait = usecs;
         }
-        else if(snd_next==fec_next+segsize) // if only one consecutive data segment loss
-        {
-          fec_next=snd_next+segsize;
-          fec_count++;
-        }
-        else // if more than one consecutive data segment loss
-        {
-          fprintf(stderr, "in gbn: consecutive losses or fec loss.\n");
-          mode=true;
-
-          fec_start=fec_lost;
-          fec_next=fec_lost;
-          fec_count=0;
+      }
+      usecs = netimg_xferwait(x) - netimg_usecs(&x->last, &now);
+      if (usecs <= 0) {
+        if (!x->err && x->tries < NETIMG_QRYTRIES) {
+          netimg_sendqry(x);
+          usecs = netimg_xferwait(x);
+        } else {
+          if (!x->err) {
+            netimg_imsgerr(progname, x);
+          }
+          netimg_xferend(x);
+          continue;
         }
       }
+      if (wait < 0 || usecs < wait) {
+        wait = usecs;
+      }
+    }
+    if (wait < 0) {
+      break;
     }
-    ack.ih_seqn=htonl(fec_lost);
-  } 
-
-  else if (ihdr.ih_type == NETIMG_FEC) // FEC pkt
-  { 
-    unsigned char FEC[datasize];
-    iov[1].iov_base = FEC;
-    iov[1].iov_len = datasize;
 
-    if(recvmsg(sd, &mh, 0)==-1)
-    {
-      close(sd);
-      fprintf(stderr, "recv img error");
-      exit(1);
+    if (dumpstats) {
+      dumpstats = 0;
+      netimg_json();
     }
-    fprintf(stderr, "netimg_recvimg: received FEC offset: 0x%x, start: 0x%x, lost: 0x%x, count: %d\n", snd_next, fec_start, (fec_count>=fwnd) ? snd_next:fec_lost, fec_count);
 
-    if(!mode)
-    {
-      //(1): lost one singel packet within this FEC window range, patch the lost one
-      if(fec_count==fwnd-1) // reconstruct the lost packet
-      {
-        for (unsigned int j=fec_start; j<snd_next; j += datasize)
-          if (j!=fec_lost)
-            fec_accum(FEC, image+j, datasize, std::min(datasize, (int)img_size-(int)j));
-        memcpy(image+fec_lost, FEC, min(datasize, (int)img_size-(int)fec_lost));
-        fprintf(stderr, "netimg_recvimg: FEC patched offset: 0x%x, start: 0x%x, count: %d\n", snd_next, fec_start, fec_count);
-
-        fec_start=snd_next;
-        fec_next=snd_next;
-        fec_count = 0;
-        fec_lost=fec_start;
-        ack.ih_seqn=htonl(fec_lost);
+#ifdef __linux__
+    n = epoll_wait(ep, evs, NETIMG_MAXIMGS, (int) ((wait+999)/1000));
+    for (i = 0; i < n; i++) {
+      netimg_recvxfer((xfer_t *) evs[i].data.ptr);
+    }
+#else
+    FD_ZERO(&rset);
+    maxsd = 0;
+    for (i = 0; i < nxfers; i++) {
+      if (!xfers[i].over) {
+        FD_SET(xfers[i].sd, &rset);
+        maxsd = xfers[i].sd > maxsd ? xfers[i].sd : maxsd;
       }
-      //(2): lost no packet within this FEC window range, throw away the FEC data, no ACK
-      else if(fec_count==fwnd)
-      {
-        fec_start=snd_next;
-        fec_next=snd_next;
-        fec_count = 0;
-        fec_lost=fec_start;
-        return;
+    }
+    tv.tv_sec = wait/1000000L;
+    tv.tv_usec = wait%1000000L;
+    n = select(maxsd+1, &rset, NULL, NULL, &tv);
+    for (i = 0; n > 0 && i < nxfers; i++) {
+      if (!xfers[i].over && FD_ISSET(xfers[i].sd, &rset)) {
+        netimg_recvxfer(&xfers[i]);
       }
-      //(3): lost more than one packet within this FEC window lost, trigger go back N mode
-      else
-      {
-        mode=true;
-        fprintf(stderr, "netimg_recvimg: in gbn: multiple losses per fwnd.\n");
-
-        fec_start=fec_lost;
-        fec_next=fec_start;
-        fec_count=0;
-        ack.ih_seqn=htonl(fec_lost);
- 
-        return;
-      } 
-    }
-
-    else // if in go back N mode and receives a FEC window packet, do nothing
-      return;
-  } 
-  else 
-  {  // NETIMG_FIN pkt
-    /* must recv here because of MSG_PEEK recv before!!, or would be to infinite loop!! */
-    recv(sd, &ihdr, sizeof(ihdr_t), 0); 
-    ack.ih_seqn=htonl(NETIMG_FINSEQ);
+    }
+#endif
   }
 
-  if (((float) random())/INT_MAX < pdrop)
-    fprintf(stderr, "netimg_recvimg: ack dropped 0x%x\n", ntohl(ack.ih_seqn));
-  else
-  {
-    err = send(sd, &ack , sizeof(ihdr_t), 0);
-    net_assert(err<0, "send ACK error");
-    fprintf(stderr, "netimg_recvimg: ack sent 0x%x\n", ntohl(ack.ih_seqn));
+#ifdef __linux__
+  close(ep);
+#endif
+  return;
+}
+
+/*
+ * netimg_xferreport: print the statistics of transfer "x" to stdout:
+ * completion time from query to NETIMG_FIN (or to the end of the
+ * transfer if it didn't complete), time to first byte, goodput over
+ * the image size, losses seen as segments skipped over on first
+ * arrival, and retransmitted and duplicate segments received.
+ */
+void
+netimg_xferreport(xfer_t *x)
+{
+  double secs, ttfb;
+  int nsegs, datasize;
+
+  if (!x->fin) {
+    x->stat.done = x->last;
+  }
+  secs = netimg_usecs(&x->stat.start, &x->stat.done)/1000000.0;
+  ttfb = x->stat.pkts ?
+    netimg_usecs(&x->stat.start, &x->stat.first)/1000000.0 : 0.0;
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  nsegs = (int) ((x->img_size+datasize-1)/datasize);
+
+  printf("netimg: %s: %s in %.3f s (first byte %.3f s), %ld bytes, "
+         "goodput %.3f Mbps\n", x->name, x->fin ? "complete" : "INCOMPLETE",
+         secs, ttfb, x->img_size,
+         secs > 0.0 ? x->img_size*8/secs/1000000.0 : 0.0);
+  printf("netimg: %s: %d segments of %d received, %ld bytes; "
+         "loss %d (%.2f%%), retransmissions %d, duplicates %d\n",
+         x->name, x->stat.pkts, nsegs, x->stat.bytes, x->stat.holes,
+         nsegs ? 100.0*x->stat.holes/nsegs : 0.0, x->stat.retx, x->stat.dups);
+  printf("netimg: %s: %d FEC patched, %d ACKs sent, %d dropped\n",
+         x->name, x->stat.fecs, x->stat.acks, x->stat.ackdrops);
+
+  return;
+}
+
+/*
+ * netimg_report: print the statistics of each transfer and, if there
+ * is more than one, the time from the first query to the last
+ * completion, and the aggregate goodput over the images completed.
+ */
+void
+netimg_report()
+{
+  struct timeval start = xfers[0].stat.start, done = xfers[0].stat.done;
+  long bytes = 0;
+  int i, nfound = 0, ncomplete = 0;
+  double secs;
+  xfer_t *x;
+
+  for (i = 0; i < nxfers; i++) {
+    x = &xfers[i];
+    if (x->err != NETIMG_FOUND) {
+      continue;
+    }
+    netimg_xferreport(x);
+    if (!nfound || netimg_usecs(&x->stat.start, &start) > 0) {
+      start = x->stat.start;
+    }
+    if (!nfound || netimg_usecs(&done, &x->stat.done) > 0) {
+      done = x->stat.done;
+    }
+    if (x->fin) {
+      bytes += x->img_size;
+      ncomplete++;
+    }
+    nfound++;
   }
-  
-  /* give the updated image to OpenGL for texturing */
-  glTexImage2D(GL_TEXTURE_2D, 0, (GLint) imsg.im_format,
-               (GLsizei) imsg.im_width, (GLsizei) imsg.im_height, 0,
-               (GLenum) imsg.im_format, GL_UNSIGNED_BYTE, image);
-  /* redisplay */
-  glutPostRedisplay();
+  if (nxfers < 2 || !nfound) {
+    return;
+  }
+
+  secs = netimg_usecs(&start, &done)/1000000.0;
+  printf("netimg: %d of %d images complete in %.3f s, %ld bytes, "
+         "goodput %.3f Mbps\n", ncomplete, nxfers, secs, bytes,
+         secs > 0.0 ? bytes*8/secs/1000000.0 : 0.0);
 
   return;
 }
 
+#ifndef NETIMG_HEADLESS
+/*
+ * netimg_recvthread: body of the receive thread, which owns the
+ * sockets of all transfers.  Tells the GLUT thread once all are
+ * over, in case none of the images was found.
+ */
+void *
+netimg_recvthread(void *arg)
+{
+  netimg_recvloop();
+  netimg_report();
+  netimg_json();
+
+  pthread_mutex_lock(&showlock);
+  recvdone = true;
+  pthread_cond_broadcast(&showcond);
+  pthread_mutex_unlock(&showlock);
+
+  return(NULL);
+}
+#endif
+
 int
 main(int argc, char *argv[])
 {
-  fec_count=0;
-  fec_start=0;
-  fec_next=0;
-  fec_lost=0;
-  mode=false;
-
-  int err;
-  char *sname, *imgname;
+  int i;
+  char *sname;
   u_short port;
 
   // parse args, see the comments for netimg_args()
-  if (netimg_args(argc, argv, &sname, &port, &imgname)) {
-    fprintf(stderr, "Usage: %s -s <server>%c<port> -q <image>.tga [ -d <drop probability [0.011, 0.11]> -w <rwnd [1, 255]> -m <mss (>40)> ]\n", argv[0], NETIMG_PORTSEP); 
+  if (netimg_args(argc, argv, &sname, &port)) {
+#ifdef NETIMG_HEADLESS
+    fprintf(stderr, "Usage: %s -s <server>%c<port> -q <image>.tga [ -d <drop probability [0.011, 0.11]> -w <rwnd [1, 255]> -m <mss (>40)> -a <ACK every N segments> -A <ACK delay ms> -j <stats file> -o <output file> ] [ <image>.tga ... ]\n", argv[0], NETIMG_PORTSEP);
+#else
+    fprintf(stderr, "Usage: %s -s <server>%c<port> -q <image>.tga [ -d <drop probability [0.011, 0.11]> -w <rwnd [1, 255]> -m <mss (>40)> -a <ACK every N segments> -A <ACK delay ms> -j <stats file> ] [ <image>.tga ... ]\n", argv[0], NETIMG_PORTSEP);
+#endif
     exit(1);
   }
+  progname = argv[0];
+#ifdef SIGUSR1
+  if (jsonname) {
+    signal(SIGUSR1, netimg_sigusr1);
+  }
+#endif
 
   srandom(NETIMG_SEED+(int)(pdrop*1000));
 
   socks_init();
 
-  sd = socks_clntinit(sname, port, rwnd*mss);  // Lab5 Task 2
-
-  if (netimg_sendqry(imgname)) {
-    err = netimg_recvimsg();
-
-    if (err == NETIMG_FOUND) { // if image received ok
-      netimg_glutinit(&argc, argv, netimg_recvimg);
-      netimg_imginit(imsg.im_format);
-      
-      /* Lab5 Task 2: set socket non blocking */
-      int nonblocking = 1;
-      ioctl(sd, FIONBIO, &nonblocking);
-
-      glutMainLoop(); /* start the GLUT main loop */
-    } else if (err == NETIMG_NFOUND) {
-      fprintf(stderr, "%s: %s image not found.\n", argv[0], imgname);
-    } else if (err == NETIMG_EVERS) {
-      fprintf(stderr, "%s: wrong version number.\n", argv[0]);
-    } else if (err == NETIMG_EBUSY) {
-      fprintf(stderr, "%s: image server busy.\n", argv[0]);
-    } else if (err == NETIMG_ESIZE) {
-      fprintf(stderr, "%s: wrong size.\n", argv[0]);
-    } else {
-      fprintf(stderr, "%s: image receive error %d.\n", argv[0], err);
+  /* Lab5 Task 2: set socket non blocking */
+  int nonblocking = 1;
+  for (i = 0; i < nxfers; i++) {
+    xfers[i].sd = socks_clntinit(sname, port, rwnd*mss);  // Lab5 Task 2
+    ioctl(xfers[i].sd, FIONBIO, &nonblocking);
+  }
+  rcvbuf = (unsigned char *) malloc(max(rwnd*mss, NETIMG_GROBUFS*NETIMG_GROSIZE));
+  net_assert((rcvbuf == NULL), "netimg: malloc");
+
+  /* all images are queried concurrently, by netimg_recvloop(), the
+     first one found is put on display, see netimg_show() */
+#ifdef NETIMG_HEADLESS
+  char fname[NETIMG_MAXFNAME+16];
+
+  netimg_recvloop();  /* returns once all transfers are over */
+  netimg_report();
+  netimg_json();
+  for (i = 0; i < nxfers; i++) {
+    if (xfers[i].err != NETIMG_FOUND) {
+      continue;
+    }
+    if (outname && nxfers > 1) {
+      snprintf(fname, sizeof(fname), "%s.%d", outname, i);
     }
+    netimg_imgsave(outname && nxfers > 1 ? fname : outname,
+                   xfers[i].name, xfers[i].image, xfers[i].img_size);
+  }
+#else
+  pthread_t tid;
+  int err = pthread_create(&tid, NULL, netimg_recvthread, NULL);
+  net_assert((err != 0), "netimg: pthread_create");
+#ifdef SIGUSR1
+  /* leave SIGUSR1 to the receive thread, to interrupt its wait */
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+#endif
+
+  /* wait for the first image found, if any */
+  pthread_mutex_lock(&showlock);
+  while (!shown && !recvdone) {
+    pthread_cond_wait(&showcond, &showlock);
+  }
+  pthread_mutex_unlock(&showlock);
+  if (!shown) {
+    pthread_join(tid, NULL);
+    return(0);
   }
 
-  socks_close(sd); // optional, but since we use connect(), might as well.
+  netimg_glutinit(&argc, argv, netimg_imgupdate);
+  netimg_imginit(imsg.im_format);
+  pthread_mutex_lock(&showlock);
+  showready = true;
+  pthread_cond_broadcast(&showcond);
+  pthread_mutex_unlock(&showlock);
+
+  glutMainLoop(); /* start the GLUT main loop */
+#endif
   return(0);
 }
@@ -57,6 +57,16 @@
                                // forwarding on CAEN over ADSL, to
                                // prevent unnecessary retransmissions
 #define NETIMG_USLEEP 500000   // 500 ms
+#define NETIMG_ACKEVERY    2   // ACK every 2 segments received in order,
+#define NETIMG_ACKDELAY   10   // or after 10 ms, whichever comes first
+#define NETIMG_FPS        30   // maximum redisplay rate, frames/sec
+#define NETIMG_MAXIMGS   128   // images fetched concurrently
+#define NETIMG_QRYTRIES   20   // queries sent before giving up
+#define NETIMG_GROSIZE 65536   // receive buffer per coalesced datagram
+#define NETIMG_GROBUFS     3   // coalesced datagrams received at once,
+                               // NETIMG_MAXWIN/SOCKS_GSOSEGS packets
+#define NETIMG_RNGSIZE  1024   // image ranges in flight from the
+                               // receive thread to the GLUT thread
 
 #define NETIMG_VERS    0x30
 
@@ -78,6 +88,11 @@
 #define NETIMG_FEC     0x60    // Lab6 & PA3
 #define NETIMG_FIN     0xa0    // PA3
 
+// NETIMG_ACK of data may be followed by a SACK bitmap of ih_size
+// bytes: bit i, counting from the least significant bit of the first
+// byte, set if the i+1st segment past ih_seqn has been received
+#define NETIMG_SACKLEN    32   // (NETIMG_MAXWIN+1)/8
+
 // special seqno's for PA3:
 #define NETIMG_MAXSEQ  2147483647 // 2^31-1
 #define NETIMG_SYNSEQ  4294967293 // 2^32-1
@@ -110,11 +125,18 @@ typedef struct {
                                // Lab6: NETIMG_FEC,
                                // PA3: NETIMG_ACK, NETIMG_FIN
   unsigned short ih_size;      // actual data size, in bytes,
-                               // not including header
+                               // not including header; for
+                               // NETIMG_ACK, size of SACK bitmap
   unsigned int ih_seqn;
 } ihdr_t;
 
 extern void netimg_glutinit(int *argc, char *argv[], void (*idlefunc)());
 extern void netimg_imginit(unsigned short format);
+extern void netimg_imgdirty(long offset, long size);
+extern void netimg_imgupdate();
+
+/* netimg-headless only, see netimghl.cpp */
+extern void netimg_imgsave(char *fname, char *imgname,
+                           unsigned char *img, long size);
 
 #endif /* __NETIMG_H__ */
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2014, 2015 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+/*
+ * Stand-in for netimglut.cpp in netimg-headless: no window, no
+ * OpenGL.  The received image is kept in memory and, at the end,
+ * written to a file or checksummed.
+ */
+#include <stdio.h>         // fprintf(), perror(), fopen()
+#include <stdlib.h>        // calloc()
+#include <assert.h>        // assert()
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+
+#include "netimg.h"
+
+extern unsigned char *image;
+extern long img_size;
+
+void
+netimg_imginit(unsigned short format)
+{
+  image = (unsigned char *)calloc(img_size, sizeof(unsigned char));
+  net_assert((image == NULL), "netimg_imginit: calloc");
+
+  return;
+}
+
+void
+netimg_imgdirty(long offset, long size)
+{
+  return;
+}
+
+void
+netimg_imgupdate()
+{
+  return;
+}
+
+void
+netimg_glutinit(int *argc, char *argv[], void (*idlefunc)())
+{
+  return;
+}
+
+/*
+ * netimg_imgsave: write the "size" bytes of raw pixels of image
+ * "imgname", received into "img", to file "fname", or, if "fname" is
+ * NULL, print their 64-bit FNV-1a checksum.
+ */
+void
+netimg_imgsave(char *fname, char *imgname, unsigned char *img, long size)
+{
+  FILE *fp;
+  unsigned long long h;
+  long i;
+
+  if (fname) {
+    fp = fopen(fname, "wb");
+    net_assert((fp == NULL), "netimg_imgsave: fopen");
+    net_assert((fwrite(img, 1, size, fp) != (size_t) size),
+               "netimg_imgsave: fwrite");
+    fclose(fp);
+    return;
+  }
+
+  h = 0xcbf29ce484222325ULL;
+  for (i = 0; i < size; i++) {
+    h = (h ^ img[i])*0x100000001b3ULL;
+  }
+  printf("netimg: %s: checksum %016llx\n", imgname, h);
+
+  return;
+}
@@ -20,6 +20,7 @@
 #include <stdio.h>         // fprintf(), perror(), fflush()
 #include <stdlib.h>        // atoi()
 #include <assert.h>        // assert()
+#include <atomic>          // std::atomic
 #ifdef _WIN32
 #include <winsock2.h>
 #else
@@ -38,11 +39,29 @@ GLdouble width, height;   /* window width and height */
 
 extern char *image;
 extern long img_size;    
+extern imsg_t imsg;
+
+/* rows of image changed since last given to OpenGL:
+   [dirtylo, dirtyhi), none if dirtylo >= dirtyhi */
+int dirtylo, dirtyhi;
+int lastframe;            /* time of last redisplay, in ms */
+
+/* lock-free ring of image ranges changed by the receive thread
+   (sole producer, netimg_imgdirty()) and not yet seen by the GLUT
+   thread (sole consumer, netimg_imgupdate()).  Head and tail only
+   ever increase, wrapping around the ring modulo NETIMG_RNGSIZE.
+   Should the ring fill up, the whole image is marked dirty. */
+struct {
+  long offset;
+  long size;
+} rng[NETIMG_RNGSIZE];
+std::atomic<unsigned int> rnghead(0), rngtail(0);
+std::atomic<bool> rngfull(false);
 
 void
 netimg_imginit(unsigned short format)
 {
-  int i, tod;
+  int i, tod, pixsize;
 
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
@@ -70,25 +89,128 @@ netimg_imginit(unsigned short format)
   /* determine pixel size */
   switch(format) {
   case GL_RGBA:
-    format = 4;
+    pixsize = 4;
     break;
   case GL_RGB:
-    format = 3;
+    pixsize = 3;
     break;
   case GL_LUMINANCE_ALPHA:
-    format = 2;
+    pixsize = 2;
     break;
   default:
-    format = 1;
+    pixsize = 1;
     break;
   }
 
   /* paint the image texture background red if color, white
      otherwise to better visualize lost segments */
-  for (i = 0; i < img_size; i += format) {
+  for (i = 0; i < img_size; i += pixsize) {
     image[i] = (unsigned char) 0xff;
   }
 
+  /* allocate the texture once, only the rows that change are given
+     to OpenGL afterwards, see netimg_imgupdate() */
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, (GLint) format,
+               (GLsizei) imsg.im_width, (GLsizei) imsg.im_height, 0,
+               (GLenum) format, GL_UNSIGNED_BYTE, image);
+  dirtylo = imsg.im_height;
+  dirtyhi = 0;
+  lastframe = -1000;
+
+  return;
+}
+
+/*
+ * netimg_imgdirty: called by the receive thread to publish that "size"
+ * bytes of image at "offset" have changed.  The bytes must have been
+ * written to image before the call.
+ */
+void
+netimg_imgdirty(long offset, long size)
+{
+  unsigned int tail = rngtail.load(std::memory_order_relaxed);
+
+  if (size <= 0) {
+    return;
+  }
+  if (tail-rnghead.load(std::memory_order_acquire) >= NETIMG_RNGSIZE) {
+    rngfull.store(true, std::memory_order_release);
+    return;
+  }
+  rng[tail%NETIMG_RNGSIZE].offset = offset;
+  rng[tail%NETIMG_RNGSIZE].size = size;
+  rngtail.store(tail+1, std::memory_order_release);
+
+  return;
+}
+
+/*
+ * netimg_imgmark: mark the rows covering "size" bytes of image at
+ * "offset" as changed since last given to OpenGL.
+ */
+static void
+netimg_imgmark(long offset, long size)
+{
+  long rowsize = (long) imsg.im_width*imsg.im_depth;
+  int lo, hi;
+
+  if (size <= 0 || !rowsize) {
+    return;
+  }
+  lo = (int) (offset/rowsize);
+  hi = (int) ((offset+size+rowsize-1)/rowsize);
+  dirtylo = lo < dirtylo ? lo : dirtylo;
+  dirtyhi = hi > dirtyhi ? hi : dirtyhi;
+
+  return;
+}
+
+/* Callback function for GLUT.
+ *
+ * netimg_imgupdate: called by GLUT when idle.  Collect the image
+ * ranges published by the receive thread and give the rows of image
+ * that have changed to OpenGL for texturing and redisplay, at most
+ * NETIMG_FPS times a second.  Changes made in between are batched
+ * until the next frame.
+ */
+void
+netimg_imgupdate()
+{
+  int now;
+  long rowsize;
+  unsigned int head, tail;
+
+  head = rnghead.load(std::memory_order_relaxed);
+  tail = rngtail.load(std::memory_order_acquire);
+  for (; head != tail; head++) {
+    netimg_imgmark(rng[head%NETIMG_RNGSIZE].offset,
+                   rng[head%NETIMG_RNGSIZE].size);
+  }
+  rnghead.store(head, std::memory_order_release);
+  if (rngfull.exchange(false, std::memory_order_acq_rel)) {
+    netimg_imgmark(0, img_size);
+  }
+
+  now = glutGet(GLUT_ELAPSED_TIME);
+  if (dirtylo >= dirtyhi || now-lastframe < 1000/NETIMG_FPS) {
+    /* nothing to do yet, leave the CPU to the receive thread */
+    usleep(1000);
+    return;
+  }
+
+  rowsize = (long) imsg.im_width*imsg.im_depth;
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, (GLint) dirtylo,
+                  (GLsizei) imsg.im_width, (GLsizei) (dirtyhi-dirtylo),
+                  (GLenum) imsg.im_format, GL_UNSIGNED_BYTE,
+                  image+dirtylo*rowsize);
+  /* redisplay */
+  glutPostRedisplay();
+
+  dirtylo = imsg.im_height;
+  dirtyhi = 0;
+  lastframe = now;
+
   return;
 }
 
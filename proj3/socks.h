@@ -21,10 +21,19 @@
 #define __SOCKS_H__
 
 #define SOCKS_UNINIT_SD -1
+#define SOCKS_GROCTL     64    // room for the UDP_GRO control message
+#define SOCKS_GSOSIZE 65000    // most bytes sent with one UDP_SEGMENT
+#define SOCKS_GSOSEGS    64    // most datagrams per UDP_SEGMENT send
+                               // or UDP_GRO receive, as in Linux
 
 extern void socks_init();
 extern int socks_servinit(char *progname, struct sockaddr_in *self, char *sname);
 extern int socks_clntinit(char *sname, u_short port, int rcvbuf);
 extern void socks_close(int td);
+extern int socks_gro(int sd);
+#ifndef _WIN32
+extern int socks_grosize(struct msghdr *msg);
+extern int socks_sendsegs(int sd, struct msghdr *msg, int n, int segsize, int *gso);
+#endif
 
 #endif /* __SOCKS_H__ */
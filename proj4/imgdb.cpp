@@ -18,7 +18,7 @@
  *
 */
 #include <stdio.h>         // fprintf(), perror(), fflush()
-#include <stdlib.h>        // atoi(), random()
+#include <stdlib.h>        // atoi(), random(), realloc()
 #include <assert.h>        // assert()
 #include <math.h>
 #include <limits.h>        // LONG_MAX, INT_MAX
@@ -52,49 +52,237 @@ using namespace std;
 #include "socks.h"
 #include "netimg.h"
 #include "imgdb.h"
+#include "rle.h"
+#include "quant.h"
 
 #define USECSPERSEC 1000000
 
 /*
- * Flow::readimg: load TGA image from file "imgname" to Flow::curimg.
+ * imgdb_quantize: convert the truecolor image of "ent" to the reduced
+ * format "qmode", one of NETIMG_CAP_QUANT.  Greyscale images are
+ * left as is.  Returns the size of the converted image, in bytes.
+ */
+static long
+imgdb_quantize(imgent *ent, unsigned char qmode)
+{
+  LTGA &img = ent->img;
+  long npixels, qsize;
+  int bpp;
+
+  npixels = (long) img.GetImageWidth()*img.GetImageHeight();
+  bpp = img.GetPixelDepth()/8;
+  if (bpp < 3) {
+    return(0);
+  }
+
+  switch (qmode) {
+  case NETIMG_CAP_RGB565:
+    qsize = npixels*2;
+    break;
+  case NETIMG_CAP_PAL8:
+    qsize = NETIMG_PALSIZE+npixels;
+    break;
+  default:
+    qsize = npixels;
+    break;
+  }
+  ent->quant = (unsigned char *) malloc(qsize);
+  net_assert((!ent->quant), "imgdb_quantize: malloc");
+
+  switch (qmode) {
+  case NETIMG_CAP_RGB565:
+    quant_rgb565(ent->quant, img.GetPixels(), npixels, bpp, img.IsBGR());
+    break;
+  case NETIMG_CAP_PAL8:
+    quant_pal8(ent->quant, img.GetPixels(), npixels, bpp, img.IsBGR());
+    break;
+  default:
+    quant_grey(ent->quant, img.GetPixels(), npixels, bpp, img.IsBGR());
+    break;
+  }
+  ent->qmode = qmode;
+
+  return(qsize);
+}
+
+/*
+ * imgcache::get: return the cached image loaded from "pathname" with
+ * LTGA load "flags" and converted to the reduced pixel format
+ * "qmode", if not 0, loading it first if it is not cached.  The
+ * image's reference count is incremented, the caller must call
+ * imgcache::release() when done with it.  "*hit" is set to 1 if the
+ * image was already cached, 0 otherwise.
+ * Returns NULL if the image can't be loaded.
+ */
+imgent *imgcache::
+get(const string &pathname, unsigned int flags, unsigned char qmode, int *hit)
+{
+  pair<string, unsigned int> key(pathname, flags | qmode << IMGDB_QSHIFT);
+  map<pair<string, unsigned int>, imgent *>::iterator it;
+  imgent *ent;
+
+  it = ents.find(key);
+  if (it != ents.end()) {
+    ent = it->second;
+    lru.erase(ent->lru);
+    *hit = 1;
+  } else {
+    ent = new imgent;
+    /* the whole image is needed to convert it */
+    if (!ent->img.LoadFromFile(pathname, qmode ? flags & ~lfStream : flags)) {
+      delete ent;
+      return(NULL);
+    }
+    ent->key = key;
+    ent->refcnt = 0;
+    ent->dropped = 0;
+    ent->size = (long) ent->img.GetImageWidth()*ent->img.GetImageHeight()*
+      (ent->img.GetPixelDepth()/8);
+    if (qmode) {
+      ent->size += imgdb_quantize(ent, qmode);
+    }
+    ents[key] = ent;
+    bytes += ent->size;
+    *hit = 0;
+  }
+
+  lru.push_front(ent);
+  ent->lru = lru.begin();
+  ent->refcnt++;
+  evict();
+
+  return(ent);
+}
+
+/*
+ * imgcache::release: drop a reference obtained from imgcache::get().
+ * The image stays cached until evicted, unless it has been dropped.
+ */
+void imgcache::
+release(imgent *ent)
+{
+  if (!--ent->refcnt && ent->dropped) {
+    lru.erase(ent->lru);
+    bytes -= ent->size;
+    delete ent;
+  }
+  evict();
+  return;
+}
+
+/*
+ * imgcache::drop: forget a bad image so that the next imgcache::get()
+ * for it reloads it from file.  The image is freed once the last
+ * flow using it releases it.
+ */
+void imgcache::
+drop(imgent *ent)
+{
+  map<pair<string, unsigned int>, imgent *>::iterator it;
+
+  it = ents.find(ent->key);
+  if (it != ents.end() && it->second == ent) {
+    ents.erase(it);
+  }
+  ent->dropped = 1;
+
+  return;
+}
+
+/*
+ * imgcache::evict: drop least recently used images no flow is using
+ * until the cache is within its budget.  Images in use are never
+ * dropped, so the cache may stay over budget.
+ */
+void imgcache::
+evict()
+{
+  list<imgent *>::iterator it = lru.end();
+  imgent *ent;
+
+  while (bytes > budget && it != lru.begin()) {
+    --it;
+    if ((*it)->refcnt) {
+      continue;
+    }
+    ent = *it;
+    it = lru.erase(it);
+    ents.erase(ent->key);
+    bytes -= ent->size;
+    delete ent;
+  }
+
+  return;
+}
+
+/*
+ * Flow::readimg: point Flow::curimg to TGA image from file "imgname",
+ * shared through the image cache, loading it from file if it is not
+ * cached.  A ready-to-serve container "imgname".pak made by imgpak is
+ * preferred over the image itself.  Uncompressed images are memory
+ * mapped instead of copied to the heap.  Compressed images are read
+ * and decoded as they are sent, see Flow::load().
+ * If the client's "caps" include NETIMG_CAP_BGR, truecolor pixels are
+ * left in the BGR(A) order they are stored in.  If they include one
+ * of NETIMG_CAP_QUANT, truecolor images are converted to that reduced
+ * format, see imgdb_quantize().
  * "imgname" must point to valid memory allocated by caller.
  * Terminate process on encountering any error.
  * Returns NETIMG_FOUND if "imgname" found, else returns NETIMG_NFOUND.
  */
 char Flow::
-readimg(char *imgname, int verbose)
+readimg(char *imgname, unsigned char caps, int verbose)
 {
   string pathname=IMGDB_FOLDER;
+  unsigned int flags;
+  unsigned char qmode;
+  int hit;
 
   if (!imgname || !imgname[0]) {
     return(NETIMG_ENAME);
   }
   
-  curimg.LoadFromFile(pathname+IMGDB_DIRSEP+imgname);
+  pathname = pathname+IMGDB_DIRSEP+imgname;
+  flags = lfMapped | lfStream | ((caps & NETIMG_CAP_BGR) ? lfKeepBGR : 0);
+  qmode = caps & NETIMG_CAP_QUANT;
+  qmode &= -qmode;   // lowest bit set, if more than one
+  curimg = cache->get(pathname+LTGA_PAKEXT, flags, qmode, &hit);
+  if (!curimg) {
+    curimg = cache->get(pathname, flags, qmode, &hit);
+  }
 
-  if (!curimg.IsLoaded()) {
+  if (!curimg) {
     return(NETIMG_NFOUND);
   }
 
   if (verbose) {
-    cerr << "Image: " << endl;
-    cerr << "       Type = " << LImageTypeString[curimg.GetImageType()] 
-         << " (" << curimg.GetImageType() << ")" << endl;
-    cerr << "      Width = " << curimg.GetImageWidth() << endl;
-    cerr << "     Height = " << curimg.GetImageHeight() << endl;
-    cerr << "Pixel depth = " << curimg.GetPixelDepth() << endl;
-    cerr << "Alpha depth = " << curimg.GetAlphaDepth() << endl;
-    cerr << "RL encoding = " << (((int) curimg.GetImageType()) > 8) << endl;
-    /* use curimg.GetPixels()  to obtain the pixel array */
+    LTGA &img = curimg->img;
+
+    cerr << "Image: " << (hit ? "(cached)" : "") << endl;
+    cerr << "       Type = " << LImageTypeString[img.GetImageType()] 
+         << " (" << img.GetImageType() << ")" << endl;
+    cerr << "      Width = " << img.GetImageWidth() << endl;
+    cerr << "     Height = " << img.GetImageHeight() << endl;
+    cerr << "Pixel depth = " << img.GetPixelDepth() << endl;
+    cerr << "Alpha depth = " << img.GetAlphaDepth() << endl;
+    cerr << "RL encoding = " << (((int) img.GetImageType()) > 8) << endl;
+    if (curimg->qmode) {
+      cerr << "  Sent as   = " << (curimg->qmode == NETIMG_CAP_RGB565 ? "RGB565" :
+                                     curimg->qmode == NETIMG_CAP_PAL8 ? "8-bit palette" :
+                                     "greyscale") << endl;
+    }
+    /* use img.GetPixels()  to obtain the pixel array */
   }
   
   return(NETIMG_FOUND);
 }
 
 /*
- * Flow::marshall_imsg: Initialize *imsg with image's specifics.
+ * Flow::marshall_imsg: Initialize *imsg with image's specifics, as
+ * sent: in a reduced pixel format if it has been converted to one.
  * Upon return, the *imsg fields are in host-byte order.
- * Return value is the size of the image in bytes.
+ * Return value is the size of the image in bytes, including the
+ * palette of a palettized image.
  *
  * Terminate process on encountering any error.
  */
@@ -102,37 +290,69 @@ double Flow::
 marshall_imsg(imsg_t *imsg)
 {
   int alpha, greyscale;
+  LTGA &img = curimg->img;
 
-  imsg->im_depth = (unsigned char)(curimg.GetPixelDepth()/8);
-  imsg->im_width = curimg.GetImageWidth();
-  imsg->im_height = curimg.GetImageHeight();
-  alpha = curimg.GetAlphaDepth();
-  greyscale = curimg.GetImageType();
+  imsg->im_depth = (unsigned char)(img.GetPixelDepth()/8);
+  imsg->im_width = img.GetImageWidth();
+  imsg->im_height = img.GetImageHeight();
+  alpha = img.GetAlphaDepth();
+  greyscale = img.GetImageType();
   greyscale = (greyscale == 3 || greyscale == 11);
   if (greyscale) {
     imsg->im_format = alpha ? GL_LUMINANCE_ALPHA : GL_LUMINANCE;
+  } else if (img.IsBGR()) {
+    imsg->im_format = alpha ? GL_BGRA : GL_BGR;
   } else {
     imsg->im_format = alpha ? GL_RGBA : GL_RGB;
   }
+  imsg->im_caps = caps | (img.IsBGR() ? NETIMG_CAP_BGR : 0);
+
+  /* converted truecolor image, alpha is dropped */
+  switch (curimg->qmode) {
+  case NETIMG_CAP_RGB565:
+    imsg->im_depth = 2;
+    imsg->im_format = GL_RGB;
+    imsg->im_caps = caps;
+    break;
+  case NETIMG_CAP_PAL8:
+    imsg->im_depth = 1;
+    imsg->im_format = GL_RGB;
+    imsg->im_caps = caps;
+    break;
+  case NETIMG_CAP_GREY:
+    imsg->im_depth = 1;
+    imsg->im_format = GL_LUMINANCE;
+    imsg->im_caps = caps;
+    break;
+  default:
+    break;
+  }
+  memset(imsg->im_rsvd, 0, sizeof(imsg->im_rsvd));
 
-  return((double) (imsg->im_width*imsg->im_height*imsg->im_depth));
+  return((double) (imsg->im_width*imsg->im_height*imsg->im_depth+pixoff));
 }
 
 
 void Flow::
-init(int sd, struct sockaddr_in *qhost, iqry_t *iqry, imsg_t *imsg, float currFi, unsigned short linkrateFIFO)
+init(int sd, struct sockaddr_in *qhost, imgcache *imgs, iqry_t *iqry, imsg_t *imsg, float currFi, unsigned short linkrateFIFO)
 {
   int err, usable;
   socklen_t optlen;
   double imgdsize;
 
-  imsg->im_type = readimg(iqry->iq_name, 1);
+  cache = imgs;
+  imsg->im_type = readimg(iqry->iq_name, iqry->iq_caps, 1);
   
   if (imsg->im_type == NETIMG_FOUND) 
   {
     // flow is in use
     in_use = 1;
     
+    // send interlaced and/or compressed if client asks for it,
+    // in a reduced pixel format if the image has been converted
+    caps = (iqry->iq_caps & (NETIMG_CAP_ILACE | NETIMG_CAP_RLE)) | curimg->qmode;
+    pixoff = curimg->qmode == NETIMG_CAP_PAL8 ? NETIMG_PALSIZE : 0;
+
     // initialize imsg
     imgdsize = marshall_imsg(imsg);
     net_assert((imgdsize > (double) LONG_MAX),
@@ -140,8 +360,12 @@ init(int sd, struct sockaddr_in *qhost, iqry_t *iqry, imsg_t *imsg, float currFi
     imgsize = (long)imgdsize;
 
     // ip points to the start of byte buffer holding image
-    ip = (char *) curimg.GetPixels();
-    snd_next = 0;
+    ip = (char *) (curimg->quant ? curimg->quant : curimg->img.GetPixels());
+    snd_next = pixoff;   // the palette goes with the imsg, see imgdb::sendimsg()
+    depth = imsg->im_depth;
+    rowsize = imsg->im_width*depth;
+    pass = 0;
+    row = 0;
 
     mss = iqry->iq_mss;
     /* make sure that the send buffer is of size at least mss. */
@@ -153,6 +377,14 @@ init(int sd, struct sockaddr_in *qhost, iqry_t *iqry, imsg_t *imsg, float currFi
       net_assert((err < 0), "Flow::init: setsockopt SNDBUF");
     }
     datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+    if (caps & NETIMG_CAP_RLE) {
+      /* segments are encoded independently, in whole pixels */
+      datasize -= datasize % depth;
+      zbuf = (unsigned char *) realloc(zbuf, datasize);
+      net_assert((!zbuf), "Flow::init: realloc");
+      zseqn = -1;
+    }
+    zsize = 0;
 
     // flow's reserved rate as specified by client
     // flow's initial finish time is the current global minimum finish time
@@ -167,11 +399,14 @@ init(int sd, struct sockaddr_in *qhost, iqry_t *iqry, imsg_t *imsg, float currFi
     msg.msg_control = NULL;
     msg.msg_controllen = 0;
     msg.msg_flags = 0;
-    
-    hdr.ih_vers = NETIMG_VERS;
-    hdr.ih_type = NETIMG_DATA;
-    iov[0].iov_base = &hdr;
-    iov[0].iov_len = sizeof(ihdr_t);
+
+    /* uncompressed segments that go out close together are sent
+       with one system call where possible; compressed ones differ
+       in size and can't be */
+    ntrain = 0;
+    gso = 1;
+    trainmax = (caps & NETIMG_CAP_RLE) ? 1 :
+      max(1, min(SOCKS_GSOSEGS, SOCKS_GSOSIZE/(int) (sizeof(ihdr_t)+datasize)));
 
     // if the flow is FIFO with TBF
     if(!frate)
@@ -194,19 +429,37 @@ init(int sd, struct sockaddr_in *qhost, iqry_t *iqry, imsg_t *imsg, float currFi
 float Flow::
 nextFi(float multiplier, bool TBF)
 {
-  /* size of this segment */
-  segsize = imgsize - snd_next;
+  /* size of this segment, interlaced segments stop at the end
+     of the row */
+  if (caps & NETIMG_CAP_ILACE) {
+    segsize = pixoff+(row+1)*rowsize - snd_next;
+  } else {
+    segsize = imgsize - snd_next;
+  }
   segsize = segsize > datasize ? datasize : segsize;
 
+  if (in_use) {
+    load(snd_next+segsize);
+  }
+
+  /* the flow is paced by the bytes actually sent, so compress
+     the segment now, once */
+  if ((caps & NETIMG_CAP_RLE) && zseqn != snd_next && in_use) {
+    zsize = rle_encode(zbuf, (unsigned char *) ip+snd_next, segsize, depth);
+    zseqn = snd_next;
+  }
+  wiresize = zsize ? zsize : segsize;
+  segtok = zsize ? (float) zsize/IMGDB_BPTOK : bpseg;
+
   if(!TBF) // if WFQ flow
   {
-    duration=segsize/(128*frate*multiplier);
+    duration=wiresize/(128*frate*multiplier);
   }
   else
   {
-    if(bavail<bpseg)
+    if(bavail<segtok)
     {
-      incre=bpseg-bavail+((float)random()/INT_MAX)*bsize;
+      incre=segtok-bavail+((float)random()/INT_MAX)*bsize;
       //bavail=min(bsize, bavail+incre);
       duration=incre/trate;
     }
@@ -223,36 +476,55 @@ nextFi(float multiplier, bool TBF)
 int Flow::
 sendpkt(int sd, int fd, float currFi)
 {
-  int bytes;
+  ihdr_t *hdr = &hdrs[ntrain];
+  struct iovec *siov = &iov[ntrain*NETIMG_NUMIOV];
 
   // update the flow's finish time to the current
   // global minimum finish time
   Fi = currFi;
 
-  iov[1].iov_base = ip+snd_next;
-  iov[1].iov_len = segsize;
-  hdr.ih_seqn = htonl(snd_next);
-  hdr.ih_size = htons(segsize);
-  
-  usleep(1000000*duration);  
+  hdr->ih_vers = NETIMG_VERS;
+  if (zsize) {
+    siov[1].iov_base = zbuf;
+    hdr->ih_type = NETIMG_RLE;
+  } else {
+    siov[1].iov_base = ip+snd_next;
+    hdr->ih_type = NETIMG_DATA;
+  }
+  siov[0].iov_base = hdr;
+  siov[0].iov_len = sizeof(ihdr_t);
+  siov[1].iov_len = wiresize;
+  hdr->ih_seqn = htonl(snd_next);
+  hdr->ih_size = htons(wiresize);
+
+  /* the train waits out the pacing of all its segments at once,
+     see Flow::flush() */
+  if (!ntrain) {
+    trainwait = 0.0;
+  }
+  trainwait += duration;
+  trainsize[ntrain] = segsize;
+  trainFi[ntrain] = Fi;
 
   if(fd==-1)
   {    
-    if(bavail<bpseg)
+    if(bavail<segtok)
     {
       bavail=min(bsize, bavail+incre);
     }
-    bavail-=bpseg;
+    bavail-=segtok;
   }
 
-  bytes = sendmsg(sd, &msg, 0);
-  net_assert((bytes < 0), "imgdb_sendimage: sendmsg");
-  net_assert((bytes != (int)(segsize+sizeof(ihdr_t))), "Flow::sendpkt: sendmsg bytes");
-  
-  fprintf(stderr, "Flow::sendpkt: flow %d: sent offset 0x%x, Fi: %.6f, %d bytes\n",
-          fd, snd_next, Fi, segsize);
+  ntrain++;
+
   snd_next += segsize;
-  
+  if ((caps & NETIMG_CAP_ILACE) && snd_next == pixoff+(row+1)*rowsize) {
+    nextrow();
+  }
+
+  /* only the last segment sent together may be short */
+  trainend = ntrain == trainmax || wiresize < datasize || (int) snd_next >= imgsize;
+
   if ((int) snd_next < imgsize) {
     return 0;
   } else {
@@ -260,6 +532,125 @@ sendpkt(int sd, int fd, float currFi)
   }
 }
 
+/*
+ * Flow::flush: wait out the pacing of the segments queued by
+ * Flow::sendpkt(), loading the image in the meantime, then send them
+ * with one system call if possible, see socks_sendsegs().  Segments
+ * are queued only as long as the scheduler would send them within
+ * IMGDB_GSOWAIT of each other anyway, see imgdb::sendpkt(), so the
+ * train leaves when its last segment is due.  "fd" is the flow's
+ * index, for logging.
+ */
+void Flow::
+flush(int sd, int fd)
+{
+  int i, bytes, size = 0;
+
+  if (!ntrain) {
+    return;
+  }
+  prefetch(trainwait);
+  for (i = 0; i < ntrain*NETIMG_NUMIOV; i++) {
+    size += iov[i].iov_len;
+  }
+  bytes = socks_sendsegs(sd, &msg, ntrain, sizeof(ihdr_t)+datasize, &gso);
+  net_assert((bytes < 0), "imgdb_sendimage: sendmsg");
+  net_assert((bytes != size), "Flow::flush: sendmsg bytes");
+
+  for (i = 0; i < ntrain; i++) {
+    fprintf(stderr, "Flow::flush: flow %d: sent offset 0x%x, Fi: %.6f, %d bytes (%d on the wire)\n",
+            fd, ntohl(hdrs[i].ih_seqn), trainFi[i], trainsize[i],
+            ntohs(hdrs[i].ih_size));
+  }
+  ntrain = 0;
+
+  return;
+}
+
+/*
+ * Flow::load: make sure the image is loaded up to byte "upto".  On
+ * read error the rest of the image is sent as zeroes and the image is
+ * dropped from the cache.  Returns 1 if the whole image is loaded.
+ */
+int Flow::
+load(long upto)
+{
+  LTGA &img = curimg->img;
+  long size;
+
+  if (curimg->quant) {
+    return(1);   // converted from the whole image
+  }
+  size = (long) img.GetImageWidth()*img.GetImageHeight()*(img.GetPixelDepth()/8);
+
+  if ((long) img.GetLoadedSize() < upto && !img.LoadMore(upto)) {
+    fprintf(stderr, "Flow::load: image read error at byte %ld\n",
+            (long) img.GetLoadedSize());
+    cache->drop(curimg);
+  }
+
+  return((long) img.GetLoadedSize() >= size);
+}
+
+/*
+ * Flow::prefetch: wait "secs" seconds before sending the next train,
+ * loading the rest of the image IMGDB_LOADCHUNK bytes at a time in
+ * the meantime, so that reading and decoding the image overlap with
+ * sending it.
+ */
+void Flow::
+prefetch(float secs)
+{
+  struct timeval now, end;
+  long usecs;
+
+  gettimeofday(&end, NULL);
+  usecs = (long) (secs*USECSPERSEC)+end.tv_usec;
+  end.tv_sec += usecs/USECSPERSEC;
+  end.tv_usec = usecs%USECSPERSEC;
+
+  while (1) {
+    gettimeofday(&now, NULL);
+    usecs = (end.tv_sec-now.tv_sec)*USECSPERSEC+end.tv_usec-now.tv_usec;
+    if (usecs <= 0 || load(curimg->img.GetLoadedSize()+IMGDB_LOADCHUNK)) {
+      break;
+    }
+  }
+
+  if (usecs > 0) {
+    usleep(usecs);
+  }
+
+  return;
+}
+
+/*
+ * Flow::nextrow: move snd_next to the start of the next row to send
+ * of an interlaced image, see netimg.h.  After the last pass, snd_next
+ * is set to the end of the image.
+ */
+void Flow::
+nextrow()
+{
+  row += NETIMG_ILSTEP(pass);
+  while (pixoff+row*rowsize >= imgsize && ++pass < NETIMG_NPASS) {
+    row = NETIMG_ILROW(pass);
+  }
+  snd_next = pass < NETIMG_NPASS ? pixoff+row*rowsize : imgsize;
+
+  return;
+}
+
+unsigned short Flow::
+done()
+{
+  in_use = 0;
+  cache->release(curimg);
+  curimg = NULL;
+
+  return (frate);
+}
+
 /*
  * imgdb_args: parses command line args.
  * Returns 0 on success or 1 on failure.
@@ -280,7 +671,7 @@ args(int argc, char *argv[])
   float frate = IMGDB_FRATE; // fraction of link for WFQ
   minflow = IMGDB_MINFLOW;
 
-  while ((c = getopt(argc, argv, "l:g:f:")) != EOF) {
+  while ((c = getopt(argc, argv, "l:g:f:c:")) != EOF) {
     switch (c) {
     case 'l':
       arg = atoi(optarg);
@@ -301,6 +692,13 @@ args(int argc, char *argv[])
       if (frate<0 || frate>1)
         return (1);
       break;
+    case 'c':
+      arg = atoi(optarg);
+      if (arg < 0) {
+        return(1);
+      }
+      imgs.setbudget((long) arg*1024*1024);  // in bytes
+      break;
     default:
       return(1);
       break;
@@ -324,7 +722,7 @@ imgdb(int argc, char *argv[])
 
   // parse args, see the comments for imgdb::args()
   if (args(argc, argv)) {
-    fprintf(stderr, "Usage: %s [ -l <linkrate [1, 10 Mbps]> -g <minflow> -f <frateWFQ>]\n", argv[0]); 
+    fprintf(stderr, "Usage: %s [ -l <linkrate [1, 10 Mbps]> -g <minflow> -f <frateWFQ> -c <image cache MB> ]\n", argv[0]); 
     exit(1);
   }
   
@@ -363,20 +761,36 @@ recvqry(int sd, struct sockaddr_in *qhost, iqry_t *iqry)
 }
 
 
+/*
+ * imgdb::sendimsg: send the imsg packet to the client.  The
+ * "palette" of a palettized image, if not NULL, is sent in the same
+ * packet, right after the imsg_t, so that the client can't get one
+ * without the other.
+ *
+ * Terminate process on encountering any error.
+ */
 void imgdb::
-sendimsg(int sd, struct sockaddr_in *qhost, imsg_t *imsg)
+sendimsg(int sd, struct sockaddr_in *qhost, imsg_t *imsg, unsigned char *palette)
 {
-  int bytes;
+  int bytes, size;
+  char pkt[sizeof(imsg_t)+NETIMG_PALSIZE];
 
   imsg->im_vers = NETIMG_VERS;
   imsg->im_width = htons(imsg->im_width);
   imsg->im_height = htons(imsg->im_height);
   imsg->im_format = htons(imsg->im_format);
 
+  size = sizeof(imsg_t);
+  memcpy(pkt, imsg, size);
+  if (palette) {
+    memcpy(pkt+size, palette, NETIMG_PALSIZE);
+    size += NETIMG_PALSIZE;
+  }
+
   // send the imsg packet to client
-  bytes = sendto(sd, (char *) imsg, sizeof(imsg_t), 0, (struct sockaddr *) qhost,
+  bytes = sendto(sd, pkt, size, 0, (struct sockaddr *) qhost,
                  sizeof(struct sockaddr_in));
-  net_assert((bytes != sizeof(imsg_t)), "imgdb::sendimsg: sendto");
+  net_assert((bytes != size), "imgdb::sendimsg: sendto");
 
   return;
 }
@@ -389,6 +803,7 @@ handleqry()
   iqry_t iqry;
   imsg_t imsg;
   struct sockaddr_in qhost;
+  Flow *flow = NULL;      // the flow started, if any
   
   imsg.im_type = recvqry(sd, &qhost, &iqry);
   if(!imsg.im_type) 
@@ -402,16 +817,17 @@ handleqry()
       if(FIFOQ.in_use) 
       {
         imsg.im_type=NETIMG_EFULL;
-        sendimsg(sd, &qhost, &imsg);
+        sendimsg(sd, &qhost, &imsg, NULL);
         return(1);        
       }
 
-      FIFOQ.init(sd, &qhost, &iqry, &imsg, currFi, linkrateFIFO);
+      FIFOQ.init(sd, &qhost, &imgs, &iqry, &imsg, currFi, linkrateFIFO);
       if(imsg.im_type==NETIMG_NFOUND)
       {   
-        sendimsg(sd, &qhost, &imsg);
+        sendimsg(sd, &qhost, &imsg, NULL);
         return(1);
       }
+      flow = &FIFOQ;
       nflow++;
       fprintf(stderr, "imgdb:handleqry: flow %d added, flow rate: %d, reserved link rate: %d\n", -1, linkrateFIFO, linkrateFIFO);
 
@@ -422,12 +838,13 @@ handleqry()
       {
         if(!WFQ[i].in_use)
         {
-          WFQ[i].init(sd, &qhost, &iqry, &imsg, currFi, 0);
+          WFQ[i].init(sd, &qhost, &imgs, &iqry, &imsg, currFi, 0);
           if(imsg.im_type==NETIMG_NFOUND)
           {   
-            sendimsg(sd, &qhost, &imsg);
+            sendimsg(sd, &qhost, &imsg, NULL);
             return(1);
           }
+          flow = &WFQ[i];
 
           nflow++;
           rsvdrate += iqry.iq_frate;
@@ -438,7 +855,7 @@ handleqry()
       if(i==IMGDB_MAXFLOW)
       {        
         imsg.im_type=NETIMG_EFULL;
-        sendimsg(sd, &qhost, &imsg);
+        sendimsg(sd, &qhost, &imsg, NULL);
         return(1);     
       }
     }
@@ -455,7 +872,7 @@ handleqry()
  
   if(imsg.im_type != NETIMG_EAGAIN)
   {
-    sendimsg(sd, &qhost, &imsg);
+    sendimsg(sd, &qhost, &imsg, flow ? flow->palette() : NULL);
     return(1);
   }
 
@@ -463,35 +880,63 @@ handleqry()
 }
 
 
-void imgdb::
-sendpkt()
+/*
+ * imgdb::pick: pick the flow whose next segment has the earliest
+ * finish time and store that time in currFi.  Returns the flow's
+ * index in WFQ[], or -1 for the FIFO flow.
+ */
+int imgdb::
+pick()
 {
   int fd = IMGDB_MAXFLOW;
-  struct timeval end;
-  int secs, usecs;
-  int done = 0;
-
-  /* pick next client to send packet and send with sleep*/
   float temp;
+
   for(int i=0; i<IMGDB_MAXFLOW; i++)
   {
+    if(!WFQ[i].in_use)
+      continue;  // no client, nothing to compute Fi from
     temp=WFQ[i].nextFi((float)linkrateWFQ/rsvdrate, 0);
-    if(WFQ[i].in_use && (fd==IMGDB_MAXFLOW || currFi>temp))
+    if(fd==IMGDB_MAXFLOW || currFi>temp)
     {
       fd=i;
       currFi=temp;
     }
   }
 
-  temp=FIFOQ.nextFi((float)linkrateWFQ/rsvdrate, 1);
-  if(FIFOQ.in_use && (fd==IMGDB_MAXFLOW || currFi>temp))
+  if(FIFOQ.in_use)
   {
-    fd=-1;
-    currFi=temp;
-    done=FIFOQ.sendpkt(sd, fd, currFi);
+    temp=FIFOQ.nextFi((float)linkrateWFQ/rsvdrate, 1);
+    if(fd==IMGDB_MAXFLOW || currFi>temp)
+    {
+      fd=-1;
+      currFi=temp;
+    }
   }
-  else
-    done=WFQ[fd].sendpkt(sd, fd, currFi);
+
+  return(fd);
+}
+
+void imgdb::
+sendpkt()
+{
+  int fd;
+  struct timeval end;
+  int secs, usecs;
+  int done = 0;
+  float firstFi;
+
+  /* pick next client to send packet; while the same client would be
+     picked again, with its next segment due within IMGDB_GSOWAIT of
+     the first one queued, queue that segment along.  The train then
+     goes out with one sleep for all of its segments, see
+     Flow::flush() */
+  fd = pick();
+  Flow *flow = (fd == -1) ? &FIFOQ : &WFQ[fd];
+  firstFi = currFi;
+  do {
+    done = flow->sendpkt(sd, fd, currFi);
+  } while (!done && !flow->trainfull() && pick() == fd && currFi-firstFi <= IMGDB_GSOWAIT);
+  flow->flush(sd, fd);
 
   if(done) 
   {
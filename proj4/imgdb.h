@@ -20,6 +20,10 @@
 #ifndef __IMGDB_H__
 #define __IMGDB_H__
 
+#include <string>
+#include <list>
+#include <map>
+#include <stdlib.h>        // free()
 #include "netimg.h"
 #include "ltga.h"
 #include "socks.h"
@@ -39,27 +43,93 @@
 #define IMGDB_MINLRATE          1   // minimum link rate, in Mbps
 #define IMGDB_MAXLRATE         10   // maximum link rate, in Mbps
 #define IMGDB_FRATE           0.5   // default fraction of link for WFQ
+#define IMGDB_CACHESIZE        64   // image cache budget, in MB
+#define IMGDB_LOADCHUNK     65536   // bytes of image loaded at a time
+#define IMGDB_GSOWAIT       0.001   // most secs a segment is held back to
+                                    // go with others, see imgdb::sendpkt()
+
+#define IMGDB_QSHIFT           16   // NETIMG_CAP_QUANT bits in imgent::key
+
+/* An image loaded by imgcache, shared by all the flows serving it. */
+struct imgent {
+  LTGA img;
+  unsigned char qmode;    // NETIMG_CAP_QUANT format of quant, 0 if none
+  unsigned char *quant;   // img converted to qmode, NULL if none
+  long size;              // size of the pixel buffers, in bytes
+  int refcnt;             // number of flows using the image
+  int dropped;            // no longer in imgcache::ents, see imgcache::drop()
+  std::pair<std::string, unsigned int> key;      // (file name, load flags
+                                                 // | qmode << IMGDB_QSHIFT)
+  std::list<imgent *>::iterator lru;             // position in imgcache::lru
+
+  imgent() { qmode = 0; quant = NULL; }
+  ~imgent() { free(quant); }
+};
+
+/* Process-wide cache of loaded images, so that flows asking for the
+   same image share one pixel buffer and only the first one goes to
+   disk.  Images no flow is using stay cached until the total size of
+   the cache exceeds its budget, least recently used first out. */
+class imgcache {
+  std::map<std::pair<std::string, unsigned int>, imgent *> ents;
+  std::list<imgent *> lru;    // most recently used first
+  long bytes;                 // total size of cached images
+  long budget;                // in bytes
+
+  void evict();
+
+public:
+  imgcache() { bytes = 0; budget = (long) IMGDB_CACHESIZE*1024*1024; }
+  void setbudget(long b) { budget = b; evict(); }
+  imgent *get(const std::string &pathname, unsigned int flags,
+              unsigned char qmode, int *hit);
+  void release(imgent *ent);
+  void drop(imgent *ent);
+};
 
 class Flow {
-  LTGA curimg;
+  imgcache *cache;
+  imgent *curimg;         // the image being sent, held until done()
   long imgsize;
   char *ip;               // pointer to start of image
   int snd_next;           // offset from start of image
 
+  unsigned char caps;     // NETIMG_CAP_* bits in effect
+  unsigned char depth;    // pixel size, in bytes
+  int pixoff;             // offset of the pixels, past the palette if any
+  int rowsize;            // in bytes
+  int pass;               // current interlace pass, see netimg.h
+  int row;                // current row, if interlaced
+
   struct sockaddr_in client;
 
   unsigned short datasize;
   int segsize;
+  int wiresize;           // segsize, or zsize if compressed
+  unsigned char *zbuf;    // segment at zseqn run-length encoded
+  int zseqn;
+  int zsize;              // size of encoded segment, 0 if sent as is
 
   float Fi;               // finish time of last pkt sent
   float duration;         // the duration needed to send next segment
 
-  ihdr_t hdr;
+  /* segments queued to go out together, see Flow::flush() */
+  ihdr_t hdrs[SOCKS_GSOSEGS];
   struct msghdr msg;
-  struct iovec iov[NETIMG_NUMIOV];
-
-  char readimg(char *imgname, int verbose);
+  struct iovec iov[SOCKS_GSOSEGS*NETIMG_NUMIOV];
+  int ntrain;             // segments queued
+  int trainmax;           // most segments queued
+  int trainend;           // the last segment queued ends the train
+  float trainwait;        // secs to wait before sending the train
+  int trainsize[SOCKS_GSOSEGS];  // of each segment, before encoding
+  float trainFi[SOCKS_GSOSEGS];  // finish time of each segment
+  int gso;                // whether to try UDP_SEGMENT
+
+  char readimg(char *imgname, unsigned char caps, int verbose);
   double marshall_imsg(imsg_t *imsg);
+  void nextrow();
+  int load(long upto);
+  void prefetch(float secs);
 
   unsigned short mss;     // receiver's maximum segment size, in bytes
 
@@ -69,6 +139,7 @@ class Flow {
   float incre;
   float bavail; // the available token number in the bucket
   float bpseg; // the token number needed per segment, excluding headers
+  float segtok; // the token number needed for the next segment
 
 public:
   int in_use;             // 1: in use; 0: not
@@ -76,14 +147,20 @@ public:
 
   unsigned short frate;   // flow rate, in Kbps
 
-  Flow() { in_use = 0; }
-  void init(int sd, struct sockaddr_in *qhost,
+  Flow() { in_use = 0; curimg = NULL; zbuf = NULL; ntrain = 0; trainend = 0; }
+  void init(int sd, struct sockaddr_in *qhost, imgcache *imgs,
             iqry_t *iqry, imsg_t *imsg, float currFi, unsigned short linkrateFIFO);
   float nextFi(float multiplier, bool TBF);
   int sendpkt(int sd, int fd, float currFi);
-  /* Flow::done: set flow to not "in_use" and return the flow's
-     reserved rate to be deducted from total reserved rate. */
-  unsigned short done() { in_use = 0; return (frate); }
+  void flush(int sd, int fd);
+  int queued() { return ntrain; }
+  int trainfull() { return trainend; }
+  /* Flow::palette: the palette of a palettized image, else NULL */
+  unsigned char *palette() { return (pixoff ? (unsigned char *) ip : NULL); }
+  /* Flow::done: set flow to not "in_use", release its image, and
+     return the flow's reserved rate to be deducted from total
+     reserved rate. */
+  unsigned short done();
 };
 
 class imgdb {
@@ -93,6 +170,7 @@ class imgdb {
 
   Flow WFQ[IMGDB_MAXFLOW];
   Flow FIFOQ;
+  imgcache imgs;
 
   unsigned short rsvdrate;  // reserved rate by WFQ flows, in Kbps
   unsigned short linkrateWFQ;  // in Kbps
@@ -105,10 +183,12 @@ class imgdb {
   short started;  // or not
 
   int args(int argc, char *argv[]);
+  int pick();
 
   // image query-reply
   char recvqry(int sd, struct sockaddr_in *qhost, iqry_t *iqry);
-  void sendimsg(int sd, struct sockaddr_in *qhost, imsg_t *imsg);
+  void sendimsg(int sd, struct sockaddr_in *qhost, imsg_t *imsg,
+                unsigned char *palette);
 
 public:
   imgdb(int argc, char *argv[]);
@@ -30,6 +30,8 @@ THE POSSIBILITY OF SUCH DAMAGE.
 //------------------------------------------------
 
 #include <string>
+#include <fstream>
+#include <stddef.h>
 
 //------------------------------------------------
 
@@ -38,6 +40,50 @@ typedef unsigned int uint;
 
 enum LImageType {itUndefined, itRGB, itRGBA, itGreyscale};
 const char *const LImageTypeString[] = { "Undefined", "RGB", "RGBA", "Greyscale" };
+// flags for LoadFromFile(): lfMapped maps uncompressed files instead of reading
+// them, lfKeepBGR leaves truecolor pixels in the BGR(A) order they are stored in,
+// lfStream only reads the header and leaves the pixels to LoadMore()
+enum LLoadFlags {lfMapped = 1, lfKeepBGR = 2, lfStream = 4};
+
+struct TGAStream;
+
+//------------------------------------------------
+// "ready-to-serve" image container written by imgpak: a page-sized
+// header, then the RGB(A) ordered pixels, then optional precomputed
+// FEC parity blocks, each section starting on a page boundary.  All
+// integers are in network byte order.  LoadFromFile() recognizes the
+// container by its magic and serves the pixels without decoding or
+// swapping them.
+#define LTGA_PAKMAGIC   "NIMGPAK1"
+#define LTGA_PAKEXT     ".pak"    // appended to the name of the source image
+#define LTGA_PAKALIGN   4096
+#define LTGA_PAKMAXFEC  8
+
+struct LTGAPakFEC
+{
+    unsigned short mss;       // segment size the parity was computed for
+    unsigned char fwnd;       // FEC window, in segments
+    unsigned char rsvd;
+    unsigned int datasize;    // bytes per parity block (data bytes per segment)
+    unsigned int nblocks;     // one block per fwnd-full of segments
+    unsigned int offset;      // of the first block, from start of file
+};
+
+struct LTGAPakHeader
+{
+    char magic[8];            // LTGA_PAKMAGIC, not NULL terminated
+    // imsg_t fields, already marshalled
+    unsigned char im_depth;   // in bytes
+    unsigned char alpha;      // depth of the alpha bitplane, in bits
+    unsigned short im_format;
+    unsigned short im_width;
+    unsigned short im_height;
+    unsigned int pixoffset;   // of the pixels, from start of file
+    unsigned int pixsize;     // in bytes
+    unsigned int nfec;        // number of valid fec[] entries
+    LTGAPakFEC fec[LTGA_PAKMAXFEC];
+};
+
 //------------------------------------------------
 class LTGA
 {
@@ -53,8 +99,17 @@ public:
     // the destructor, cleans up the memory
     virtual ~LTGA();
     // this method loads a tga file. It clears all the data
-    // if needed.
-    bool LoadFromFile(const std::string &filename);
+    // if needed. flags is a combination of LLoadFlags. With lfMapped
+    // an uncompressed (type 2 or 3) file is memory mapped and GetPixels()
+    // points into the mapping instead of into a heap copy of the file.
+    bool LoadFromFile(const std::string &filename, uint flags = 0);
+    // with lfStream, reads and decodes pixels until at least the first size
+    // bytes of the pixel buffer are loaded, in their final order. Returns false
+    // on read error, in which case the rest of the pixels are zeroed. Returns
+    // true at once if these pixels are already loaded.
+    bool LoadMore(size_t size);
+    // returns the number of bytes of the pixel buffer loaded so far
+    size_t GetLoadedSize() const;
     // this method clears the data, calling it is not nessesary, since it is
     // automatically called by the destructor
     void Clear();
@@ -79,7 +134,19 @@ public:
     
 	// Returns true if an image has been loaded
 	bool IsLoaded(void) const { return m_loaded; }
+	// Returns true if the pixel buffer is backed by a file mapping
+	bool IsMapped(void) const { return m_map != 0; }
+	// Returns true if truecolor pixels are in BGR(A) rather than RGB(A) order
+	bool IsBGR(void) const { return m_bgr; }
+	// Returns the precomputed FEC parity blocks for segments of mss bytes,
+	// carrying datasize bytes of the image each, and FEC windows of fwnd
+	// segments if the image was loaded mapped from a container holding
+	// enough of them, 0 otherwise. Block i is the XOR of the fwnd segments
+	// starting at byte i*fwnd*datasize of the image.
+	const byte *GetParity(uint mss, uint datasize, uint fwnd);
 
+    // swaps the R and B channels in place, toggling IsBGR(). The image must
+    // be fully loaded.
     void SwapRB();
 
     // IG added this -- may not work for every little file you got.
@@ -100,6 +167,23 @@ protected:
     LImageType m_type;
     // m_loaded is true if a file has been loaded
     bool m_loaded;
+    // the file mapping m_pixels points into, 0 if m_pixels is malloc'ed
+    byte *m_map;
+    // the length of the file mapping
+    size_t m_mapsize;
+    // m_bgr is true if the pixels have not been swapped to RGB(A)
+    bool m_bgr;
+    // m_pak is true if the image was loaded from an imgpak container
+    bool m_pak;
+    // state of an lfStream load still in progress, 0 if none
+    TGAStream *m_stream;
+
+    // loads the image from an imgpak container
+    bool LoadPak(std::ifstream &file, const std::string &filename, uint flags);
+
+    // maps filename and points m_pixels at offset into the mapping.
+    // Returns false if the file can't be mapped or is too short.
+    bool MapFile(const std::string &filename, size_t offset, size_t size);
 };
 
 //------------------------------------------------
@@ -18,7 +18,7 @@
  *
 */
 #include <stdio.h>         // fprintf(), perror(), fflush()
-#include <stdlib.h>        // atoi()
+#include <stdlib.h>        // atoi(), calloc(), malloc()
 #include <assert.h>        // assert()
 #include <limits.h>        // LONG_MAX
 #include <math.h>          // ceil()
@@ -46,6 +46,7 @@
 
 #include "netimg.h"
 #include "socks.h"
+#include "rle.h"
 
 int sd;                   // socket descriptor
 imsg_t imsg;
@@ -54,6 +55,10 @@ unsigned char *image;
 unsigned short mss;       // receiver's maximum segment size, in bytes
 unsigned char rwnd;       // receiver's window, in packets, of size <= mss
 unsigned short frate;     // flow rate, in Kbps
+unsigned char caps;       // NETIMG_CAP_* bits to ask for
+unsigned char *rowlvl;    // per image row, see netimg_ilfill()
+unsigned char *zbuf;      // to receive NETIMG_RLE segments into
+unsigned char palette[NETIMG_PALSIZE];  // of a palettized image, comes with imsg
 
 /*
  * netimg_args: parses command line args.
@@ -62,8 +67,8 @@ unsigned short frate;     // flow rate, in Kbps
  * "*sname" points to the server's name, and "port" points to the port
  * to connect at server, in network byte order.  Both "*sname", and
  * "port" must be allocated by caller.  The variable "*imgname" points
- * to the name of the image to search for.  The global variables mss
- * and rwnd are initialized.
+ * to the name of the image to search for.  The global variables mss,
+ * rwnd, frate, and caps are initialized.
  *
  * Nothing else is modified.
  */
@@ -81,8 +86,9 @@ netimg_args(int argc, char *argv[], char **sname, u_short *port, char **imgname)
   rwnd = NETIMG_RCVWIN;
   mss = NETIMG_MSS;
   frate = NETIMG_FRATE;
+  caps = NETIMG_CAP_BGR | NETIMG_CAP_RLE;
 
-  while ((c = getopt(argc, argv, "s:q:w:m:r:")) != EOF) {
+  while ((c = getopt(argc, argv, "s:q:w:m:r:id:")) != EOF) {
     switch (c) {
     case 's':
       for (p = optarg+strlen(optarg)-1;  // point to last character of
@@ -125,6 +131,20 @@ netimg_args(int argc, char *argv[], char **sname, u_short *port, char **imgname)
       }
       frate = (unsigned short) arg;
       break;
+    case 'i':
+      caps |= NETIMG_CAP_ILACE;
+      break;
+    case 'd':
+      if (!strcmp(optarg, "565")) {
+        caps |= NETIMG_CAP_RGB565;
+      } else if (!strcmp(optarg, "pal")) {
+        caps |= NETIMG_CAP_PAL8;
+      } else if (!strcmp(optarg, "grey")) {
+        caps |= NETIMG_CAP_GREY;
+      } else {
+        return(1);
+      }
+      break;
     default:
       return(1);
       break;
@@ -146,7 +166,12 @@ netimg_args(int argc, char *argv[], char **sname, u_short *port, char **imgname)
  * filename of the image the client is searching for, the query
  * message also carries the receiver's window size (rwnd), maximum
  * segment size (mss), and flow rate (frate).
- * All three are global variables.
+ * All three are global variables.  The client also tells the
+ * server it can display BGR(A) images, which saves the server
+ * from swapping the pixels to RGB(A), that it can decode run-length
+ * encoded segments, whether it wants the image sent interlaced, and
+ * whether it wants the image in a reduced pixel format (global
+ * variable caps).
  *
  * On send error, return 0, else return 1
  */
@@ -161,6 +186,7 @@ netimg_sendqry(char *imgname)
   iqry.iq_mss = htons(mss);      // global
   iqry.iq_rwnd = rwnd;           // global
   iqry.iq_frate = htons(frate);  // global
+  iqry.iq_caps = caps;           // global
   strcpy(iqry.iq_name, imgname); 
   bytes = send(sd, (char *) &iqry, sizeof(iqry_t), 0);
   if (bytes != sizeof(iqry_t)) {
@@ -179,22 +205,37 @@ netimg_sendqry(char *imgname)
  * packet. Upon return, all the integer fields of imsg MUST be in HOST
  * BYTE ORDER. If msg_type is NETIMG_FOUND, compute the size of the
  * incoming image and store the size in the global variable
- * "img_size".
+ * "img_size".  The palette of a palettized image follows the imsg_t
+ * in the same packet and is stored in the global variable "palette".
  */
 char
 netimg_recvimsg()
 {
   int bytes;
   double imgdsize;
+  struct msghdr msg;
+  struct iovec iov[NETIMG_NUMIOV];
 
   /* receive imsg packet and check its version and type */
-  bytes = recv(sd, (char *) &imsg, sizeof(imsg_t), 0); // imsg global
-  if (bytes != sizeof(imsg_t)) {
+  memset((char *) &msg, 0, sizeof(struct msghdr));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = NETIMG_NUMIOV;
+  iov[0].iov_base = &imsg;                      // imsg global
+  iov[0].iov_len = sizeof(imsg_t);
+  iov[1].iov_base = palette;
+  iov[1].iov_len = NETIMG_PALSIZE;
+  bytes = recvmsg(sd, &msg, 0);
+  if (bytes < (int) sizeof(imsg_t)) {
     return(NETIMG_ESIZE);
   }
   if (imsg.im_vers != NETIMG_VERS) {
     return(NETIMG_EVERS);
   }
+  if (bytes != (int) sizeof(imsg_t) +
+      (imsg.im_type == NETIMG_FOUND && (imsg.im_caps & NETIMG_CAP_PAL8) ?
+       NETIMG_PALSIZE : 0)) {
+    return(NETIMG_ESIZE);
+  }
 
   if (imsg.im_type == NETIMG_FOUND) {
     imsg.im_height = ntohs(imsg.im_height);
@@ -204,12 +245,62 @@ netimg_recvimsg()
     imgdsize = (double) (imsg.im_height*imsg.im_width*(u_short)imsg.im_depth);
     net_assert((imgdsize > (double) LONG_MAX), 
                "netimg_recvimsg: image too big");
+    if (imsg.im_caps & NETIMG_CAP_PAL8) {
+      imgdsize += NETIMG_PALSIZE;               // palette precedes pixels
+    }
     img_size = (long) imgdsize;                 // global
   }
 
   return((char) imsg.im_type);
 }
 
+/*
+ * netimg_ilfill: called after receiving "size" bytes at offset "seqn"
+ * of an interlaced image.  A row received in pass i stands in for the
+ * rows below it up to the next row of the same pass, i.e., for
+ * (8 >> i)-1 rows, until their own data arrive, so that each pass
+ * refines a full-frame preview of the image.  rowlvl[] records the
+ * height of the block each row was last filled from, 1 once the row's
+ * own data is in, 0 if nothing has arrived for it yet.  Rows filled
+ * from a smaller block are not overwritten.  The palette of a
+ * palettized image precedes the rows and is left alone.
+ *
+ * Returns the offset past the last byte written.
+ */
+unsigned int
+netimg_ilfill(unsigned int seqn, int size)
+{
+  int pixoff, rowsize, y, x, h, i;
+  unsigned int end;
+
+  pixoff = (imsg.im_caps & NETIMG_CAP_PAL8) ? NETIMG_PALSIZE : 0;
+  end = seqn+size;
+  if (seqn < (unsigned int) pixoff) {
+    return(end);
+  }
+
+  rowsize = imsg.im_width*imsg.im_depth;
+  y = (seqn-pixoff)/rowsize;
+  x = (seqn-pixoff)%rowsize;     // segment doesn't span rows
+  h = (y & 7) ? (y & -y) : 8;
+
+  for (i = 1; i < h && y+i < imsg.im_height; i++) {
+    if (rowlvl[y+i] && rowlvl[y+i] < h) {
+      continue;
+    }
+    memcpy(image+pixoff+(y+i)*rowsize+x, image+seqn, size);
+    end = pixoff+(y+i)*rowsize+x+size;
+    if (x+size == rowsize) {
+      rowlvl[y+i] = h;
+    }
+  }
+  if (x+size == rowsize) {
+    rowlvl[y] = 1;
+  }
+
+  return(end);
+}
+
 /* Callback function for GLUT.
  *
  * netimg_recvimg: called by GLUT when idle. On each call, receive a
@@ -223,7 +314,8 @@ void
 netimg_recvimg(void)
 {
   ihdr_t hdr;  // memory to hold packet header
-  int bytes;
+  int bytes, size;
+  unsigned int end;
   struct msghdr msg;
   struct iovec iov[NETIMG_NUMIOV];
    
@@ -305,14 +397,42 @@ netimg_recvimg(void)
 
     fprintf(stderr, "netimg_recvimg: received offset 0x%x, %d bytes\n",
             hdr.ih_seqn, hdr.ih_size);
+    size = hdr.ih_size;
+  } else if (hdr.ih_type == NETIMG_RLE) {
+    /*
+     * A run-length encoded segment is received into zbuf and decoded
+     * into the image buffer at the offset given by its sequence
+     * number.  Each segment is encoded on its own, so losing one
+     * doesn't affect the others.
+     */
+    net_assert((hdr.ih_size > mss || hdr.ih_seqn >= (unsigned int) img_size),
+               "netimg_recvimg: bad RLE segment");
+    iov[1].iov_base = zbuf;
+    iov[1].iov_len = hdr.ih_size;
+
+    bytes = recvmsg(sd, &msg, 0);
+    hdr.ih_size = ntohs(hdr.ih_size);
+    hdr.ih_seqn = ntohl(hdr.ih_seqn);
+    net_assert((bytes != (int)(sizeof(ihdr_t)+hdr.ih_size)),
+               "netimg_recvimg: recv bad packet size");
+
+    size = rle_decode(image+hdr.ih_seqn, img_size-hdr.ih_seqn,
+                      zbuf, hdr.ih_size, imsg.im_depth);
+    net_assert((size < 0), "netimg_recvimg: bad RLE segment");
+
+    fprintf(stderr, "netimg_recvimg: received offset 0x%x, %d bytes (%d encoded)\n",
+            hdr.ih_seqn, size, hdr.ih_size);
+  } else {
+    return;
   }
-  
-  /* give the updated image to OpenGL for texturing */
-  glTexImage2D(GL_TEXTURE_2D, 0, (GLint) imsg.im_format,
-               (GLsizei) imsg.im_width, (GLsizei) imsg.im_height, 0,
-               (GLenum) imsg.im_format, GL_UNSIGNED_BYTE, image);
-  /* redisplay */
-  glutPostRedisplay();
+
+  /* fill in the interlaced preview, then give the updated image
+     to OpenGL for texturing */
+  end = hdr.ih_seqn+size;
+  if (imsg.im_caps & NETIMG_CAP_ILACE) {
+    end = netimg_ilfill(hdr.ih_seqn, size);
+  }
+  netimg_imgupdate(hdr.ih_seqn, end-hdr.ih_seqn);
 
   return;
 }
@@ -328,7 +448,7 @@ main(int argc, char *argv[])
   // parse args, see the comments for netimg_args()
   if (netimg_args(argc, argv, &sname, &port, &imgname)) {
     fprintf(stderr,
-            "Usage: %s -s <server>%c<port> -q <image>.tga [ -w <rwnd [1, 255]> -m <mss (>40)> -r <flow rate [10, 262140]> ]\n",
+            "Usage: %s -s <server>%c<port> -q <image>.tga [ -w <rwnd [1, 255]> -m <mss (>40)> -r <flow rate [10, 262140]> -i -d <565|pal|grey> ]\n",
             argv[0], NETIMG_PORTSEP); 
     exit(1);
   }
@@ -344,7 +464,16 @@ main(int argc, char *argv[])
 
     if (err == NETIMG_FOUND) { // if image received ok
       netimg_glutinit(&argc, argv, netimg_recvimg);
-      netimg_imginit(imsg.im_format);
+      netimg_imginit(&imsg);
+      if (imsg.im_caps & NETIMG_CAP_PAL8) {
+        memcpy(image, palette, NETIMG_PALSIZE);
+      }
+      if (imsg.im_caps & NETIMG_CAP_ILACE) {
+        rowlvl = (unsigned char *) calloc(imsg.im_height, sizeof(unsigned char));
+      }
+      if (imsg.im_caps & NETIMG_CAP_RLE) {
+        zbuf = (unsigned char *) malloc(mss);
+      }
       ioctl(sd, FIONBIO, &nonblock); // set socket non blocking
       glutMainLoop(); /* start the GLUT main loop */
     } else if (err == NETIMG_NFOUND) {
@@ -63,6 +63,38 @@
 #define NETIMG_EFULL   0x0e      // link full, used in Lab8
 
 #define NETIMG_DATA    0x20
+#define NETIMG_RLE     0x21     // NETIMG_DATA, run-length encoded, see rle.cpp
+
+// iqry_t::iq_caps bits, set by the client for each optional
+// feature it supports:
+#define NETIMG_CAP_BGR    0x01   // can display GL_BGR/GL_BGRA images
+#define NETIMG_CAP_ILACE  0x02   // wants image rows sent interlaced
+#define NETIMG_CAP_RLE    0x04   // can decode NETIMG_RLE segments
+// reduced pixel formats, at most one is in effect (the lowest bit set):
+#define NETIMG_CAP_RGB565 0x08   // 16-bit RGB565, network byte order
+#define NETIMG_CAP_PAL8   0x10   // 8-bit indices, palette sent with the imsg
+#define NETIMG_CAP_GREY   0x20   // 8-bit luminance
+#define NETIMG_CAP_QUANT  (NETIMG_CAP_RGB565 | NETIMG_CAP_PAL8 | NETIMG_CAP_GREY)
+
+#define NETIMG_PALSIZE    768    // 256 RGB colors, follow the imsg_t
+
+// Interlaced images are sent in NETIMG_NPASS passes over the rows,
+// pass i sends every NETIMG_ILSTEP(i)-th row starting from row
+// NETIMG_ILROW(i), i.e., rows 0, 8, 16, ..., then rows 4, 12, 20, ...,
+// then rows 2, 6, 10, ..., then all the odd rows.  A segment never
+// spans more than one row.
+#define NETIMG_NPASS       4
+#define NETIMG_ILROW(i)    ((i) ? 8 >> (i) : 0)
+#define NETIMG_ILSTEP(i)   ((i) ? 16 >> (i) : 8)
+
+// GL 1.2 pixel formats, Windows' gl.h stops at 1.1
+#ifndef GL_BGR
+#define GL_BGR       0x80E0
+#define GL_BGRA      0x80E1
+#endif
+#ifndef GL_UNSIGNED_SHORT_5_6_5
+#define GL_UNSIGNED_SHORT_5_6_5  0x8363
+#endif
 
 #define NETIMG_FRATE       512   // flow rate, in Kbps
 #define NETIMG_MINFRATE     10   // in Kbps
@@ -73,7 +105,7 @@ typedef struct {                  // NETIMG_SYNQRY
   unsigned char iq_type;
   unsigned short iq_mss;          // receiver's maximum segment size, in bytes
   unsigned char iq_rwnd;          // receiver's window size, in number of packets of mss
-  unsigned char iq_rsvd;          // reserved field
+  unsigned char iq_caps;          // client capabilities, NETIMG_CAP_* bits
   unsigned short iq_frate;        // flow rate, in Kbps
   char iq_name[NETIMG_MAXFNAME];  // must be NULL terminated
 } iqry_t;
@@ -81,9 +113,11 @@ typedef struct {                  // NETIMG_SYNQRY
 typedef struct {               
   unsigned char im_vers;
   unsigned char im_type;       // NETIMG_FOUND, NETIMG_NFOUND, or one of the error codes
-  unsigned char im_rsvd[3];    // unused
+  unsigned char im_caps;       // NETIMG_CAP_* bits in effect for this image
+  unsigned char im_rsvd[2];    // unused
   unsigned char im_depth;      // in bytes, not in bits as
-                               // returned by LTGA.GetPixelDepth()
+                               // returned by LTGA.GetPixelDepth(),
+                               // of the pixels as sent
   unsigned short im_format;
   unsigned short im_width;
   unsigned short im_height;
@@ -98,6 +132,7 @@ typedef struct {
 } ihdr_t;
 
 extern void netimg_glutinit(int *argc, char *argv[], void (*idlefunc)());
-extern void netimg_imginit(unsigned short format);
+extern void netimg_imginit(imsg_t *imsg);
+extern void netimg_imgupdate(unsigned int seqn, int size);
 
 #endif /* __NETIMG_H__ */
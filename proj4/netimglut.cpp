@@ -21,9 +21,10 @@
 #include <stdlib.h>        // atoi()
 #include <assert.h>        // assert()
 #ifdef _WIN32
-#include <winsock2.h>
+#include <winsock2.h>      // htons()
 #else
 #include <unistd.h>
+#include <arpa/inet.h>     // htons()
 #endif
 #ifdef __APPLE__
 #include <GLUT/glut.h>
@@ -32,17 +33,23 @@
 #endif
 
 #include "netimg.h"
+#include "quant.h"
 
 int wd;                   /* GLUT window handle */
 GLdouble width, height;   /* window width and height */
 
 extern char *image;
 extern long img_size;    
+extern imsg_t imsg;
+char *texels;             /* what is displayed: image or its expansion */
+GLenum textype;           /* type of the texel components */
 
 void
-netimg_imginit(unsigned short format)
+netimg_imginit(imsg_t *imsg)
 {
-  int i, tod;
+  int i, tod, red, pixsize;
+  long npixels;
+  unsigned short format = imsg->im_format;
 
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
@@ -56,6 +63,9 @@ netimg_imginit(unsigned short format)
   glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE); 
   glEnable(GL_TEXTURE_2D);
 
+  /* rows of 1-, 2-, or 3-byte pixels needn't be 4-byte aligned */
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
 /* 
 #if PBO
   int pbod;
@@ -66,32 +76,97 @@ netimg_imginit(unsigned short format)
 #else
 */
   image = (char *)calloc(img_size, sizeof(unsigned char));
+  npixels = (long) imsg->im_width*imsg->im_height;
+
+  /* reduced formats are expanded for display, see netimg_imgupdate() */
+  textype = GL_UNSIGNED_BYTE;
+  texels = image;
+  if (imsg->im_caps & NETIMG_CAP_RGB565) {
+    /* OpenGL takes RGB565 in host byte order */
+    textype = GL_UNSIGNED_SHORT_5_6_5;
+    glPixelStorei(GL_UNPACK_SWAP_BYTES, htons(1) != 1);
+  } else if (imsg->im_caps & NETIMG_CAP_PAL8) {
+    texels = (char *)calloc(npixels*3, sizeof(unsigned char));
+  }
+
+  /* paint the red channel: the third byte of a BGR(A) pixel, the
+     top 5 bits of an RGB565 pixel */
+  red = (format == GL_BGR || format == GL_BGRA) ? 2 : 0;
 
   /* determine pixel size */
   switch(format) {
   case GL_RGBA:
-    format = 4;
+  case GL_BGRA:
+    pixsize = 4;
     break;
   case GL_RGB:
-    format = 3;
+  case GL_BGR:
+    pixsize = textype == GL_UNSIGNED_SHORT_5_6_5 ? 2 : 3;
     break;
   case GL_LUMINANCE_ALPHA:
-    format = 2;
+    pixsize = 2;
     break;
   default:
-    format = 1;
+    pixsize = 1;
     break;
   }
 
   /* paint the image texture background red if color, white
      otherwise to better visualize lost segments */
-  for (i = 0; i < img_size; i += format) {
-    image[i] = (unsigned char) 0xff;
+  for (i = red; i < npixels*pixsize; i += pixsize) {
+    texels[i] = (char) (pixsize == 2 && format == GL_RGB ? 0xf8 : 0xff);
   }
 
   return;
 }
 
+/*
+ * netimg_glformat: the internal texture format to store an image of
+ * pixel "format" in.  BGR(A) is only valid as the format of the
+ * client's pixel data, OpenGL stores it as RGB(A).
+ */
+static unsigned short
+netimg_glformat(unsigned short format)
+{
+  switch(format) {
+  case GL_BGRA:
+    return(GL_RGBA);
+  case GL_BGR:
+    return(GL_RGB);
+  default:
+    return(format);
+  }
+}
+
+/*
+ * netimg_imgupdate: called after "size" bytes of the image have been
+ * received at offset "seqn" to give the updated image to OpenGL for
+ * texturing.  The pixels received of a palettized image are expanded
+ * to RGB first, the palette having come with the imsg.
+ */
+void
+netimg_imgupdate(unsigned int seqn, int size)
+{
+  long npixels, first, last;
+
+  if (imsg.im_caps & NETIMG_CAP_PAL8) {
+    npixels = (long) imsg.im_width*imsg.im_height;
+    first = seqn-NETIMG_PALSIZE;
+    last = first+size < npixels ? first+size : npixels;
+    quant_expand((unsigned char *) texels+first*3,
+                 (unsigned char *) image+NETIMG_PALSIZE+first,
+                 (unsigned char *) image, last-first);
+  }
+
+  glTexImage2D(GL_TEXTURE_2D, 0, (GLint) netimg_glformat(imsg.im_format),
+               (GLsizei) imsg.im_width, (GLsizei) imsg.im_height, 0,
+               (GLenum) imsg.im_format, textype, texels);
+  /* redisplay */
+  glutPostRedisplay();
+
+  return;
+}
+
 /* Callback functions for GLUT */
 
 void 
@@ -0,0 +1,287 @@
+/* 
+ * Copyright (c) 2015 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University 
+ * may not be used to endorse or promote products derived from this 
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "netimg.h"
+#include "quant.h"
+
+/*
+ * Converters from 24- or 32-bit truecolor pixels of "bpp" bytes each
+ * to the reduced formats a client can ask for, see NETIMG_CAP_RGB565
+ * and friends in netimg.h.  The source is in BGR(A) order if "bgr" is
+ * set, RGB(A) otherwise, alpha is dropped.
+ *
+ * The compiler vectorizes a per-pixel loop only if the pixel size and
+ * channel offsets are constants, so each loop is an always-inlined
+ * kernel that the public functions below call once per combination
+ * of "bpp" and "bgr".  The kernels also need quant.o built with -O3,
+ * see the Makefile; check with -fopt-info-vec-optimized.  On x86,
+ * de-interleaving 24-bit pixels takes pshufb, so each function also
+ * has an SSSE3 copy, picked at run time as in ltga.cpp.
+*/
+
+#define QUANT_INLINE  static inline __attribute__((always_inline))
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUANT_SSSE3
+#define QUANT_SSSE3_CALL(f, ...) \
+  if (__builtin_cpu_supports("ssse3")) { \
+    f##_ssse3(__VA_ARGS__); \
+    return; \
+  }
+#else
+#define QUANT_SSSE3_CALL(f, ...)
+#endif
+
+/* call KERNEL(args, bpp, ri, bi) with constant bpp (3 or 4), ri, bi */
+#define QUANT_DISPATCH(KERNEL, bpp, bgr, ...) \
+  if (bpp == 4) { \
+    if (bgr) KERNEL(__VA_ARGS__, 4, 2, 0); else KERNEL(__VA_ARGS__, 4, 0, 2); \
+  } else { \
+    if (bgr) KERNEL(__VA_ARGS__, 3, 2, 0); else KERNEL(__VA_ARGS__, 3, 0, 2); \
+  }
+
+QUANT_INLINE void
+quant_rgb565k(unsigned char *__restrict dst, const unsigned char *__restrict src,
+              long npixels, const int bpp, const int ri, const int bi)
+{
+  unsigned int v;
+  long i;
+
+  for (i = 0; i < npixels; i++) {
+    v = ((src[bpp*i+ri] & 0xf8) << 8) | ((src[bpp*i+1] & 0xfc) << 3)
+      | (src[bpp*i+bi] >> 3);
+    dst[2*i] = (unsigned char) (v >> 8);
+    dst[2*i+1] = (unsigned char) v;
+  }
+
+  return;
+}
+
+#ifdef QUANT_SSSE3
+__attribute__((target("ssse3"))) static void
+quant_rgb565_ssse3(unsigned char *dst, unsigned char *src, long npixels, int bpp, int bgr)
+{
+  QUANT_DISPATCH(quant_rgb565k, bpp, bgr, dst, src, npixels);
+}
+#endif
+
+/*
+ * quant_rgb565(): convert "npixels" pixels at "src" to 16-bit
+ * RGB565 pixels at "dst", in network byte order.
+*/
+void
+quant_rgb565(unsigned char *dst, unsigned char *src, long npixels, int bpp, int bgr)
+{
+  QUANT_SSSE3_CALL(quant_rgb565, dst, src, npixels, bpp, bgr);
+  QUANT_DISPATCH(quant_rgb565k, bpp, bgr, dst, src, npixels);
+
+  return;
+}
+
+QUANT_INLINE void
+quant_greyk(unsigned char *__restrict dst, const unsigned char *__restrict src,
+            long npixels, const int bpp, const int ri, const int bi)
+{
+  long i;
+
+  for (i = 0; i < npixels; i++) {
+    dst[i] = (unsigned char)
+      ((77*src[bpp*i+ri] + 150*src[bpp*i+1] + 29*src[bpp*i+bi]) >> 8);
+  }
+
+  return;
+}
+
+#ifdef QUANT_SSSE3
+__attribute__((target("ssse3"))) static void
+quant_grey_ssse3(unsigned char *dst, unsigned char *src, long npixels, int bpp, int bgr)
+{
+  QUANT_DISPATCH(quant_greyk, bpp, bgr, dst, src, npixels);
+}
+#endif
+
+/*
+ * quant_grey(): convert "npixels" pixels at "src" to 8-bit luminance
+ * at "dst", using the BT.601 weights in 8-bit fixed point.
+*/
+void
+quant_grey(unsigned char *dst, unsigned char *src, long npixels, int bpp, int bgr)
+{
+  QUANT_SSSE3_CALL(quant_grey, dst, src, npixels, bpp, bgr);
+  QUANT_DISPATCH(quant_greyk, bpp, bgr, dst, src, npixels);
+
+  return;
+}
+
+#define QUANT_NBINS  32768   // RGB555 histogram
+#define QUANT_NCOLORS  256
+
+#define QUANT_BIN(r, g, b)  ((((r) >> 3) << 10) | (((g) >> 3) << 5) | ((b) >> 3))
+#define QUANT_CHUNK  1024    // pixels binned per vectorized pass
+
+/*
+ * quant_bink(): the RGB555 bins of "npixels" pixels at "src".  Only
+ * this part of quant_pal8() vectorizes; counting and looking up the
+ * bins are a scatter and a gather, and stay scalar.
+*/
+QUANT_INLINE void
+quant_bink(unsigned short *__restrict bins, const unsigned char *__restrict src,
+           long npixels, const int bpp, const int ri, const int bi)
+{
+  long i;
+
+  for (i = 0; i < npixels; i++) {
+    bins[i] = (unsigned short)
+      QUANT_BIN(src[bpp*i+ri], src[bpp*i+1], src[bpp*i+bi]);
+  }
+
+  return;
+}
+
+#ifdef QUANT_SSSE3
+__attribute__((target("ssse3"))) static void
+quant_bin_ssse3(unsigned short *bins, unsigned char *src, long npixels, int bpp, int bgr)
+{
+  QUANT_DISPATCH(quant_bink, bpp, bgr, bins, src, npixels);
+}
+#endif
+
+/*
+ * quant_bin(): as quant_bink(), for any "bpp" (3 or 4) and "bgr".
+*/
+static void
+quant_bin(unsigned short *bins, unsigned char *src, long npixels, int bpp, int bgr)
+{
+  QUANT_SSSE3_CALL(quant_bin, bins, src, npixels, bpp, bgr);
+  QUANT_DISPATCH(quant_bink, bpp, bgr, bins, src, npixels);
+
+  return;
+}
+
+static long *quant_hist;
+
+static int
+quant_cmpbins(const void *a, const void *b)
+{
+  long ca = quant_hist[*(const int *) a], cb = quant_hist[*(const int *) b];
+  return(ca < cb ? 1 : (ca > cb ? -1 : 0));
+}
+
+/*
+ * quant_pal8(): convert "npixels" pixels at "src" to 8-bit indices
+ * into a palette of QUANT_NCOLORS RGB colors.  "dst" receives the
+ * palette, NETIMG_PALSIZE bytes, followed by the indices.
+ *
+ * The palette is made of the most popular colors of the image after
+ * rounding to RGB555 (popularity algorithm), every other color is
+ * mapped to its nearest palette entry.
+*/
+void
+quant_pal8(unsigned char *dst, unsigned char *src, long npixels, int bpp, int bgr)
+{
+  unsigned char *palette, *map;
+  unsigned short chunk[QUANT_CHUNK];
+  int *bins, nbins, ncolors, bin, i, j, best, d, dr, dg, db, bestd;
+  long p, n, k;
+
+  quant_hist = (long *) calloc(QUANT_NBINS, sizeof(long));
+  bins = (int *) malloc(QUANT_NBINS*sizeof(int));
+  map = (unsigned char *) malloc(QUANT_NBINS);
+
+  for (p = 0; p < npixels; p += n) {
+    n = npixels-p < QUANT_CHUNK ? npixels-p : QUANT_CHUNK;
+    quant_bin(chunk, src+p*bpp, n, bpp, bgr);
+    for (k = 0; k < n; k++) {
+      quant_hist[chunk[k]]++;
+    }
+  }
+
+  /* the palette: most popular bins first */
+  for (nbins = 0, bin = 0; bin < QUANT_NBINS; bin++) {
+    if (quant_hist[bin]) {
+      bins[nbins++] = bin;
+    }
+  }
+  qsort(bins, nbins, sizeof(int), quant_cmpbins);
+  ncolors = nbins < QUANT_NCOLORS ? nbins : QUANT_NCOLORS;
+
+  palette = dst;
+  memset(palette, 0, NETIMG_PALSIZE);
+  for (i = 0; i < ncolors; i++) {
+    palette[3*i] = (unsigned char) (((bins[i] >> 10) << 3) | 4);
+    palette[3*i+1] = (unsigned char) ((((bins[i] >> 5) & 0x1f) << 3) | 4);
+    palette[3*i+2] = (unsigned char) (((bins[i] & 0x1f) << 3) | 4);
+    map[bins[i]] = (unsigned char) i;
+  }
+
+  /* map the less popular bins to the nearest palette entry */
+  for (j = ncolors; j < nbins; j++) {
+    bin = bins[j];
+    best = 0;
+    bestd = 1 << 30;
+    for (i = 0; i < ncolors; i++) {
+      dr = (int) palette[3*i] - ((((bin >> 10)) << 3) | 4);
+      dg = (int) palette[3*i+1] - ((((bin >> 5) & 0x1f) << 3) | 4);
+      db = (int) palette[3*i+2] - (((bin & 0x1f) << 3) | 4);
+      d = dr*dr + dg*dg + db*db;
+      if (d < bestd) {
+        bestd = d;
+        best = i;
+      }
+    }
+    map[bin] = (unsigned char) best;
+  }
+
+  dst += NETIMG_PALSIZE;
+  for (p = 0; p < npixels; p += n) {
+    n = npixels-p < QUANT_CHUNK ? npixels-p : QUANT_CHUNK;
+    quant_bin(chunk, src+p*bpp, n, bpp, bgr);
+    for (k = 0; k < n; k++) {
+      dst[p+k] = map[chunk[k]];
+    }
+  }
+
+  free(map);
+  free(bins);
+  free(quant_hist);
+  quant_hist = NULL;
+
+  return;
+}
+
+/*
+ * quant_expand(): expand "npixels" palette indices at "src" to RGB
+ * pixels at "dst", using the NETIMG_PALSIZE-byte "palette" laid out
+ * by quant_pal8().  "src" may be anywhere in the image.
+*/
+void
+quant_expand(unsigned char *dst, unsigned char *src, unsigned char *palette,
+             long npixels)
+{
+  long i;
+
+  for (i = 0; i < npixels; i++, dst += 3) {
+    memcpy(dst, palette+3*src[i], 3);
+  }
+
+  return;
+}
@@ -0,0 +1,29 @@
+/* 
+ * Copyright (c) 2014, 2015 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University 
+ * may not be used to endorse or promote products derived from this 
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __QUANT_H__
+#define __QUANT_H__
+
+extern void quant_rgb565(unsigned char *dst, unsigned char *src, long npixels, int bpp, int bgr);
+extern void quant_grey(unsigned char *dst, unsigned char *src, long npixels, int bpp, int bgr);
+extern void quant_pal8(unsigned char *dst, unsigned char *src, long npixels, int bpp, int bgr);
+extern void quant_expand(unsigned char *dst, unsigned char *src,
+                         unsigned char *palette, long npixels);
+
+#endif // __QUANT_H__
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2015 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+
+/*
+ * quanttest: palettizes a random image with quant_pal8() and expands
+ * it back with quant_expand() one segment at a time, as the client
+ * does on receiving each segment, see netimg_imgupdate().  Every
+ * expanded pixel must be its index's palette entry.  Exits with 0 if
+ * all pixels match, 1 otherwise.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "netimg.h"
+#include "quant.h"
+
+#define QTEST_WIDTH   97
+#define QTEST_HEIGHT  61
+#define QTEST_SEGSIZE 1000   // indices per segment
+
+int
+main(int argc, char *argv[])
+{
+  unsigned char *src, *image, *texels, *palette, *pixels;
+  long npixels, first, n, i;
+  int bpp, nbad, bad = 0;
+
+  npixels = (long) QTEST_WIDTH*QTEST_HEIGHT;
+  srandom(48914);
+  for (bpp = 3; bpp <= 4; bpp++) {
+    src = (unsigned char *) malloc(npixels*bpp);
+    image = (unsigned char *) malloc(NETIMG_PALSIZE+npixels);
+    texels = (unsigned char *) calloc(npixels*3, 1);
+    for (i = 0; i < npixels*bpp; i++) {
+      src[i] = (unsigned char) random();
+    }
+
+    quant_pal8(image, src, npixels, bpp, 0);
+    palette = image;
+    pixels = image+NETIMG_PALSIZE;
+
+    for (first = 0; first < npixels; first += n) {
+      n = npixels-first < QTEST_SEGSIZE ? npixels-first : QTEST_SEGSIZE;
+      quant_expand(texels+first*3, pixels+first, palette, n);
+    }
+
+    for (nbad = 0, i = 0; i < npixels; i++) {
+      if (memcmp(texels+i*3, palette+3*pixels[i], 3)) {
+        nbad++;
+      }
+    }
+    fprintf(stderr, "quanttest: %d bytes per pixel: %d of %ld pixels wrong\n",
+            bpp, nbad, npixels);
+    bad += nbad;
+
+    free(texels);
+    free(image);
+    free(src);
+  }
+
+  return(bad ? 1 : 0);
+}
@@ -0,0 +1,129 @@
+/* 
+ * Copyright (c) 2015 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University 
+ * may not be used to endorse or promote products derived from this 
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+
+#include <cstring>
+#include "rle.h"
+
+/*
+ * Segments are run-length encoded the way TGA encodes its pixels, one
+ * packet at a time.  The packet header byte h encodes a run of
+ * (h & 0x7f)+1 copies of the one pixel that follows if its high bit is
+ * set, else (h+1) pixels follow verbatim.  Pixels are "depth" bytes
+ * long and every segment holds whole pixels, so each segment can be
+ * decoded on its own.
+*/
+#define RLE_RUN   0x80
+#define RLE_MAXN   128
+
+/*
+ * rle_encode(): encode the "srcsize" bytes at "src" into "dst", which
+ * must be able to hold at least "srcsize" bytes.  "srcsize" must be a
+ * multiple of "depth".  Returns the size of the encoded data, or 0 if
+ * it would not be smaller than "srcsize", in which case the content of
+ * "dst" is undefined.
+*/
+int
+rle_encode(unsigned char *dst, unsigned char *src, int srcsize, int depth)
+{
+  unsigned char *end, *lit, *p;
+  int dstsize, n;
+
+  end = src+srcsize;
+  dstsize = 0;
+  lit = src;      // start of pending literal pixels
+
+  for (p = src; p < end; ) {
+    /* length of the run starting at p */
+    for (n = 1; n < RLE_MAXN && p+n*depth < end &&
+           !memcmp(p, p+n*depth, depth); n++);
+
+    if (n < 2 && p+depth < end && (p-lit)/depth < RLE_MAXN-1) {
+      p += depth;
+      continue;
+    }
+    if (n < 2) {
+      p += depth;   // close the literal packet with this pixel
+    }
+
+    /* flush pending literals */
+    if (p > lit) {
+      if (dstsize+1+(p-lit) >= srcsize) {
+        return(0);
+      }
+      dst[dstsize++] = (unsigned char) ((p-lit)/depth-1);
+      memcpy(dst+dstsize, lit, p-lit);
+      dstsize += p-lit;
+    }
+
+    if (n >= 2) {
+      if (dstsize+1+depth >= srcsize) {
+        return(0);
+      }
+      dst[dstsize++] = (unsigned char) (RLE_RUN | (n-1));
+      memcpy(dst+dstsize, p, depth);
+      dstsize += depth;
+      p += n*depth;
+    }
+    lit = p;
+  }
+
+  return(dstsize);
+}
+
+/*
+ * rle_decode(): decode the "srcsize" bytes of encoded data at "src"
+ * into "dst", which can hold "dstsize" bytes.  Returns the number of
+ * bytes decoded, or -1 if the encoded data is malformed or would
+ * overflow "dst".
+*/
+int
+rle_decode(unsigned char *dst, int dstsize, unsigned char *src, int srcsize, int depth)
+{
+  unsigned char *end, *out;
+  int n, i;
+
+  end = src+srcsize;
+  out = dst;
+
+  while (src < end) {
+    n = (*src & ~RLE_RUN)+1;
+    if (out+n*depth > dst+dstsize) {
+      return(-1);
+    }
+    if (*src++ & RLE_RUN) {
+      if (src+depth > end) {
+        return(-1);
+      }
+      for (i = 0; i < n; i++, out += depth) {
+        memcpy(out, src, depth);
+      }
+      src += depth;
+    } else {
+      if (src+n*depth > end) {
+        return(-1);
+      }
+      memcpy(out, src, n*depth);
+      out += n*depth;
+      src += n*depth;
+    }
+  }
+
+  return((int) (out-dst));
+}
@@ -31,6 +31,10 @@
 #include <arpa/inet.h>     // htons(), inet_ntoa()
 #include <sys/types.h>     // u_short
 #include <sys/socket.h>    // socket API, setsockopt(), getsockname()
+#include <sys/uio.h>       // struct iovec
+#include <netinet/udp.h>   // UDP_SEGMENT, if available
+#include <errno.h>         // errno
+#include <stdint.h>        // uint16_t
 #endif
 
 #include "netimg.h"
@@ -176,3 +180,60 @@ socks_close(int td)
 #endif // _WIN32
   return;
 }
+
+#ifndef _WIN32
+/*
+ * socks_sendsegs: send the "n" datagrams of "msg", each made up of
+ * NETIMG_NUMIOV consecutive entries of msg->msg_iov, and all but the
+ * last "segsize" bytes long.  If "*gso" is set, they are handed to the
+ * kernel with one sendmsg() and UDP_SEGMENT, to be split into
+ * datagrams there.  If the kernel can't do that, e.g., because the
+ * datagrams don't fit the path MTU, "*gso" is cleared, and, as when
+ * UDP_SEGMENT is not available at all, the datagrams are sent with
+ * one sendmsg() each.  msg->msg_iovlen is ignored.
+ *
+ * Returns the number of bytes sent, or -1 on error.
+ */
+int
+socks_sendsegs(int sd, struct msghdr *msg, int n, int segsize, int *gso)
+{
+  struct msghdr m = *msg;
+  int i, bytes, total = 0;
+#ifdef UDP_SEGMENT
+  char ctl[CMSG_SPACE(sizeof(uint16_t))];
+  struct cmsghdr *cm;
+
+  if (*gso && n > 1) {
+    m.msg_iovlen = n*NETIMG_NUMIOV;
+    m.msg_control = ctl;
+    m.msg_controllen = sizeof(ctl);
+    cm = CMSG_FIRSTHDR(&m);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *((uint16_t *) CMSG_DATA(cm)) = (uint16_t) segsize;
+    bytes = sendmsg(sd, &m, 0);
+    if (bytes >= 0 || (errno != EINVAL && errno != EIO &&
+                       errno != ENOPROTOOPT && errno != EOPNOTSUPP)) {
+      return(bytes);
+    }
+    fprintf(stderr, "socks_sendsegs: UDP_SEGMENT unavailable, sending one datagram at a time\n");
+    *gso = 0;
+    m.msg_control = msg->msg_control;
+    m.msg_controllen = msg->msg_controllen;
+  }
+#endif
+
+  m.msg_iovlen = NETIMG_NUMIOV;
+  for (i = 0; i < n; i++) {
+    m.msg_iov = msg->msg_iov+i*NETIMG_NUMIOV;
+    bytes = sendmsg(sd, &m, 0);
+    if (bytes < 0) {
+      return(-1);
+    }
+    total += bytes;
+  }
+
+  return(total);
+}
+#endif // _WIN32
@@ -21,10 +21,16 @@
 #define __SOCKS_H__
 
 #define SOCKS_UNINIT_SD -1
+#define SOCKS_GSOSIZE 65000    // most bytes sent with one UDP_SEGMENT
+#define SOCKS_GSOSEGS    64    // most datagrams per UDP_SEGMENT send,
+                               // as in Linux
 
 extern void socks_init();
 extern int socks_servinit(char *progname, struct sockaddr_in *self, char *sname);
 extern int socks_clntinit(char *sname, u_short port, int rcvbuf);
 extern void socks_close(int td);
+#ifndef _WIN32
+extern int socks_sendsegs(int sd, struct msghdr *msg, int n, int segsize, int *gso);
+#endif
 
 #endif /* __SOCKS_H__ */